@@ -0,0 +1,164 @@
+/*
+Measures the round-trip latency of calls to an agent on the same host, once
+through MQTT (embedded broker on the loopback interface) and once through a
+shared-memory ring channel.
+
+usage: vrpc-ring-latency [<calls> [<broker-port>]]
+*/
+
+#include <vrpc/adapter.hpp>
+#include <vrpc/agent.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+class Counter {
+ public:
+  static int next(int value) { return value + 1; }
+
+  int value() const { return _value; }
+
+ private:
+  int _value = 0;
+};
+
+namespace vrpc {
+VRPC_CTOR(Counter)
+VRPC_STATIC_FUNCTION(Counter, int, next, int)
+VRPC_CONST_MEMBER_FUNCTION(Counter, int, value)
+}  // namespace vrpc
+
+typedef std::chrono::steady_clock Clock;
+
+static std::string request(std::size_t i) {
+  return vrpc::json{{"c", "Counter"},
+                    {"f", "next"},
+                    {"a", {i}},
+                    {"i", std::to_string(i)},
+                    {"s", "bench/replies"}}
+      .dump();
+}
+
+static void report(const std::string& name, std::vector<double> us) {
+  std::sort(us.begin(), us.end());
+  auto at = [&](double q) { return us[std::size_t(q * (us.size() - 1))]; };
+  std::cout << std::left << std::setw(6) << name << std::right << std::fixed
+            << std::setprecision(1) << " p50 " << std::setw(8) << at(0.5)
+            << " us   p99 " << std::setw(8) << at(0.99) << " us   p99.9 "
+            << std::setw(8) << at(0.999) << " us" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  const std::size_t calls = argc > 1 ? std::stoul(argv[1]) : 100000;
+  const std::uint16_t port = argc > 2 ? std::stoi(argv[2]) : 18883;
+
+  vrpc::VrpcAgent::Options options;
+  options.agent = "ring-latency";
+  options.embedded_broker_port = port;
+  options.ring_transport = true;
+  options.reply_qos = mqtt::qos::at_most_once;
+  options.subscription_qos = mqtt::qos::at_most_once;
+  auto agent = vrpc::VrpcAgent::create(options);
+  std::thread server([&]() { agent->serve(); });
+
+  // Discovery and the MQTT measurement
+  std::vector<double> mqtt_us;
+  mqtt_us.reserve(calls);
+  const std::string prefix("vrpc/ring-latency/");
+  std::unique_ptr<vrpc::RingChannel> channel;
+  boost::asio::io_context ioc;
+  auto client = mqtt::make_async_client(ioc, "127.0.0.1", port);
+  Clock::time_point sent;
+  bool ring = false;
+  auto call = [&]() {
+    sent = Clock::now();
+    client->async_publish(prefix + "Counter/__static__/next",
+                          request(mqtt_us.size()), mqtt::qos::at_most_once);
+  };
+  client->set_client_id("ring-latency-client");
+  client->set_clean_session(true);
+  client->set_connack_handler([&](bool, mqtt::connect_return_code rc) {
+    if (rc != mqtt::connect_return_code::accepted) return true;
+    client->async_subscribe("bench/replies", mqtt::qos::at_most_once);
+    client->async_subscribe("bench/ring", mqtt::qos::at_most_once);
+    client->async_subscribe(prefix + "__agentInfo__", mqtt::qos::at_most_once);
+    return true;
+  });
+  client->set_publish_handler([&](mqtt::optional<std::uint16_t>,
+                                  mqtt::publish_options,
+                                  mqtt::buffer topic,
+                                  mqtt::buffer contents) {
+    if (topic == prefix + "__agentInfo__") {
+      const auto info = vrpc::json::parse(std::string(contents));
+      if (info.value("status", "") == "online" && !ring) {
+        ring = info.value("ring", false);
+        call();
+      }
+      return true;
+    }
+    if (topic == "bench/ring") {
+      // the agent created the channel, we open it by the path answered
+      const auto j = vrpc::json::parse(std::string(contents));
+      if (j.find("r") != j.end()) {
+        channel = vrpc::RingChannel::open(j["r"].get<std::string>());
+      }
+      client->async_disconnect();
+      return true;
+    }
+    mqtt_us.push_back(
+        std::chrono::duration<double, std::micro>(Clock::now() - sent).count());
+    if (mqtt_us.size() < calls) {
+      call();
+      return true;
+    }
+    // done, ask for a ring channel
+    client->async_publish(
+        prefix + "__ring__",
+        vrpc::json{{"s", "bench/ring"}, {"p", ::getpid()}, {"k", 1024 * 1024}}
+            .dump(),
+        mqtt::qos::at_least_once);
+    return true;
+  });
+  client->async_connect();
+  ioc.run();
+  if (!ring || !channel) {
+    std::cerr << "Agent does not offer the ring transport" << std::endl;
+    agent->end();
+    server.join();
+    return EXIT_FAILURE;
+  }
+
+  // The ring measurement
+  std::vector<double> ring_us;
+  ring_us.reserve(calls);
+  std::string reply;
+  const std::chrono::microseconds spin(
+      std::thread::hardware_concurrency() > 1 ? 100 : 0);
+  for (std::size_t i = 0; i < calls; ++i) {
+    const std::string payload(request(i));
+    const auto start = Clock::now();
+    while (!channel->requests().try_write(payload.data(), payload.size())) {
+    }
+    if (!channel->replies().read(reply, spin, std::chrono::milliseconds(5000))) {
+      std::cerr << "Ring call timed out" << std::endl;
+      break;
+    }
+    ring_us.push_back(
+        std::chrono::duration<double, std::micro>(Clock::now() - start)
+            .count());
+  }
+  channel->close();
+
+  std::cout << calls << " sequential calls of Counter::next" << std::endl;
+  report("mqtt", mqtt_us);
+  if (!ring_us.empty()) report("ring", ring_us);
+
+  agent->end();
+  server.join();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,26 @@
+#include <stdexcept>
+#include <string>
+
+class Echo {
+  std::string _last;
+
+ public:
+  static std::string repeat(const std::string& text, int times) {
+    std::string result;
+    for (int i = 0; i < times; ++i) result += text;
+    return result;
+  }
+
+  // bound as raw function, takes and returns plain bytes
+  static std::string reverse(const std::string& bytes) {
+    if (bytes.empty()) throw std::invalid_argument("Nothing to reverse");
+    return std::string(bytes.rbegin(), bytes.rend());
+  }
+
+  std::string echo(const std::string& text) {
+    _last = text;
+    return text;
+  }
+
+  std::string last() const { return _last; }
+};
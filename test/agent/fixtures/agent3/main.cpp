@@ -0,0 +1,53 @@
+#include <vrpc/adapter.hpp>
+#include <vrpc/agent.hpp>
+#include "Echo.hpp"
+#include "Probe.hpp"
+
+namespace vrpc {
+  VRPC_CTOR(Echo)
+  VRPC_STATIC_FUNCTION(Echo, std::string, repeat, const std::string&, int)
+  VRPC_RAW_STATIC_FUNCTION(Echo, std::string, reverse, const std::string&)
+  VRPC_MEMBER_FUNCTION(Echo, std::string, echo, const std::string&)
+  VRPC_CONST_MEMBER_FUNCTION(Echo, std::string, last)
+
+  VRPC_CTOR(Probe)
+  VRPC_STATIC_FUNCTION(Probe, std::size_t, pendingBytes)
+  VRPC_CONST_MEMBER_FUNCTION(Probe, bool, ready)
+}
+
+// Agent with the optional transports enabled, tested using plain MQTT
+int main(int argc, char** argv) {
+  vrpc::VrpcAgent::Options options;
+  options.domain = "test.vrpc.ext";
+  options.agent = "agent3";
+  options.broker = argc > 1 ? argv[1] : "mqtt://broker:1883";
+  // messages exceeding a packet are chunked
+  options.max_packet_size = 1024;
+  // large replies to clients asking for it are lz4 compressed
+  options.compression_threshold = 512;
+  // bursts of replies to clients asking for it are grouped
+  options.coalesce_window_us = 20000;
+  // a single subscription, calls are routed by the agent
+  options.wildcard_subscriptions = true;
+  // v5 requests carry their reply route as properties
+  options.mqtt5 = true;
+  // clients sharing the host (pid namespace) call through rings
+  options.ring_transport = true;
+  const std::string role(argc > 2 ? argv[2] : "");
+  if (role == "flow") {
+    // throttled by acknowledgements, reconnects quickly (through a proxy)
+    options.agent = "flow";
+    options.max_inflight_calls = 4;
+    options.max_pending_bytes = 4096;
+    options.reconnect_max_ms = 500;
+  } else if (!role.empty()) {
+    // member of a pool (without rings and wildcard)
+    options.agent = "pooled";
+    options.pool = "pooled";
+    options.pool_member = role;
+  }
+  auto agent = vrpc::VrpcAgent::create(options);
+  Probe::agent() = agent;
+  agent->serve();
+  return EXIT_SUCCESS;
+}
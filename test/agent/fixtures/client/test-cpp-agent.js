@@ -3,8 +3,83 @@
 /* global describe, context, before, after, it */
 const { VrpcClient } = require('vrpc')
 const assert = require('assert')
+const fs = require('fs')
+const mqtt = require('mqtt')
+const net = require('net')
 const sinon = require('sinon')
 
+// Plain MQTT client, used for envelopes and transports the Node.js client
+// does not know about
+class RawClient {
+  constructor (options = {}) {
+    this._options = options
+    this._messages = []
+    this._waiting = []
+  }
+
+  async connect () {
+    this._client = mqtt.connect('mqtt://broker', this._options)
+    this._client.on('message', (topic, payload, packet) => {
+      const message = { topic, payload, properties: packet.properties || {} }
+      const waiting = this._waiting.find(x => x.topic === topic)
+      if (!waiting) return this._messages.push(message)
+      this._waiting.splice(this._waiting.indexOf(waiting), 1)
+      clearTimeout(waiting.timer)
+      waiting.resolve(message)
+    })
+    await new Promise((resolve, reject) => {
+      this._client.once('connect', resolve)
+      this._client.once('error', reject)
+    })
+  }
+
+  subscribe (topic) {
+    return new Promise((resolve, reject) => {
+      this._client.subscribe(topic, { qos: 1 }, err =>
+        err ? reject(err) : resolve()
+      )
+    })
+  }
+
+  publish (topic, payload, options = {}) {
+    return new Promise((resolve, reject) => {
+      this._client.publish(topic, payload, { qos: 1, ...options }, err =>
+        err ? reject(err) : resolve()
+      )
+    })
+  }
+
+  publishJson (topic, value, options) {
+    return this.publish(topic, JSON.stringify(value), options)
+  }
+
+  // Resolves with the next message on topic, rejects after timeout
+  receive (topic, timeout = 2000) {
+    const message = this._messages.find(x => x.topic === topic)
+    if (message) {
+      this._messages.splice(this._messages.indexOf(message), 1)
+      return Promise.resolve(message)
+    }
+    return new Promise((resolve, reject) => {
+      const waiting = { topic, resolve }
+      waiting.timer = setTimeout(() => {
+        this._waiting.splice(this._waiting.indexOf(waiting), 1)
+        reject(new Error(`Nothing received on ${topic}`))
+      }, timeout)
+      this._waiting.push(waiting)
+    })
+  }
+
+  async receiveJson (topic, timeout) {
+    const { payload } = await this.receive(topic, timeout)
+    return JSON.parse(payload.toString())
+  }
+
+  end () {
+    return new Promise(resolve => this._client.end(false, resolve))
+  }
+}
+
 describe('Testing C++ agent using Node.js client', () => {
   /*******************************
    * agent and class information *
@@ -472,4 +547,1135 @@ describe('Testing C++ agent using Node.js client', () => {
       })
     })
   })
+  /********************
+   * chunked transfer *
+   ********************/
+  describe('(4) chunked transfer', () => {
+    const prefix = 'test.vrpc.ext/agent3'
+    const sender = 'test.vrpc.ext/client/chunks'
+    let client
+
+    // Splits payload into chunks of size bytes (header excluded)
+    const toChunks = (payload, size, id) => {
+      const total = Math.ceil(payload.length / size)
+      const chunks = []
+      for (let seq = 0; seq < total; ++seq) {
+        const header = Buffer.alloc(20)
+        header.write('VCHK')
+        header.writeBigUInt64LE(BigInt(id), 4)
+        header.writeUInt32LE(seq, 12)
+        header.writeUInt32LE(total, 16)
+        chunks.push(
+          Buffer.concat([header, payload.slice(seq * size, (seq + 1) * size)])
+        )
+      }
+      return chunks
+    }
+
+    // Collects the chunks of a single transfer
+    const receiveChunks = async (topic) => {
+      const chunks = []
+      let total = 1
+      while (chunks.length < total) {
+        const { payload } = await client.receive(topic)
+        assert.strictEqual(payload.slice(0, 4).toString(), 'VCHK')
+        chunks[payload.readUInt32LE(12)] = payload
+        total = payload.readUInt32LE(16)
+      }
+      return chunks
+    }
+
+    before(async () => {
+      client = new RawClient()
+      await client.connect()
+      await client.subscribe(sender)
+      await client.subscribe(`${prefix}/__agentInfo__`)
+    })
+    after(async () => {
+      await client.end()
+    })
+    it('should announce the maximum packet size', async () => {
+      const info = await client.receiveJson(`${prefix}/__agentInfo__`)
+      assert.strictEqual(info.status, 'online')
+      assert.strictEqual(info.maxPacketSize, 1024)
+    })
+    it('should send replies exceeding a packet in chunks', async () => {
+      await client.publishJson(`${prefix}/Echo/__static__/repeat`, {
+        c: 'Echo',
+        f: 'repeat',
+        a: ['chunk', 1000],
+        i: '1',
+        s: sender
+      })
+      const chunks = await receiveChunks(sender)
+      assert(chunks.length > 1)
+      chunks.forEach(chunk => assert(chunk.length < 1024))
+      const reply = JSON.parse(
+        Buffer.concat(chunks.map(chunk => chunk.slice(20))).toString()
+      )
+      assert.strictEqual(reply.i, '1')
+      assert.strictEqual(reply.r, 'chunk'.repeat(1000))
+    })
+    it('should reassemble chunked requests', async () => {
+      const text = 'request'.repeat(500)
+      const request = Buffer.from(
+        JSON.stringify({
+          c: 'Echo',
+          f: 'repeat',
+          a: [text, 1],
+          i: '2',
+          s: sender
+        })
+      )
+      const topic = `${prefix}/Echo/__static__/repeat`
+      for (const chunk of toChunks(request, 900, 2)) {
+        await client.publish(topic, chunk)
+      }
+      const chunks = await receiveChunks(sender)
+      const reply = JSON.parse(
+        Buffer.concat(chunks.map(chunk => chunk.slice(20))).toString()
+      )
+      assert.strictEqual(reply.i, '2')
+      assert.strictEqual(reply.r, text)
+    })
+    it('should drop malformed chunks and keep serving', async () => {
+      const topic = `${prefix}/Echo/__static__/repeat`
+      const [chunk] = toChunks(Buffer.from('{"c":"Echo"}'), 4, 3)
+      // sequence number beyond the total
+      chunk.writeUInt32LE(7, 12)
+      chunk.writeUInt32LE(2, 16)
+      await client.publish(topic, chunk)
+      await client.publishJson(topic, {
+        c: 'Echo',
+        f: 'repeat',
+        a: ['ok', 1],
+        i: '3',
+        s: sender
+      })
+      const reply = await client.receiveJson(sender)
+      assert.strictEqual(reply.i, '3')
+      assert.strictEqual(reply.r, 'ok')
+    })
+  })
+  /******************
+   * batch requests *
+   ******************/
+  describe('(5) batch requests', () => {
+    const topic = 'test.vrpc/agent2/__batch__'
+    const sender = 'test.vrpc/client/batches'
+    let client
+    before(async () => {
+      client = new RawClient()
+      await client.connect()
+      await client.subscribe(sender)
+    })
+    after(async () => {
+      await client.end()
+    })
+    it('should answer all calls of a batch in a single message', async () => {
+      await client.publishJson(topic, {
+        s: sender,
+        b: [
+          { c: 'Bar', f: 'staticIncrement', a: [1], i: '1' },
+          { c: 'Bar', f: 'staticIncrement', a: [41], i: '2' }
+        ]
+      })
+      const replies = await client.receiveJson(sender)
+      assert.deepStrictEqual(
+        replies.map(({ i, r }) => [i, r]),
+        [
+          ['1', 2],
+          ['2', 42]
+        ]
+      )
+    })
+    it('should fail entries individually', async () => {
+      await client.publishJson(topic, {
+        s: sender,
+        b: [
+          { c: 'Bar', f: 'doesNotExist', a: [], i: '1' },
+          { c: 'Bar', f: 'staticIncrement', a: [1], i: '2' }
+        ]
+      })
+      const replies = await client.receiveJson(sender)
+      assert.strictEqual(replies.length, 2)
+      assert(replies[0].e)
+      assert.strictEqual(replies[1].r, 2)
+    })
+    it('should reject a batch without calls', async () => {
+      await client.publishJson(topic, { s: sender, b: 'nothing', i: '1' })
+      const reply = await client.receiveJson(sender)
+      assert.strictEqual(reply.e, 'Invalid batch, expected an array of calls')
+    })
+    it('should drop malformed batches and keep serving', async () => {
+      await client.publish(topic, '{"s":')
+      await client.publishJson(topic, {
+        s: sender,
+        b: [{ c: 'Bar', f: 'staticIncrement', a: [2], i: '1' }]
+      })
+      const replies = await client.receiveJson(sender)
+      assert.strictEqual(replies[0].r, 3)
+    })
+  })
+  /*****************************
+   * references within a batch *
+   *****************************/
+  describe('(6) references within a batch', () => {
+    const topic = 'test.vrpc/agent2/__batch__'
+    const sender = 'test.vrpc/client/references'
+    let client
+    before(async () => {
+      client = new RawClient()
+      await client.connect()
+      await client.subscribe(sender)
+    })
+    after(async () => {
+      await client.end()
+    })
+    it('should pass results on as arguments', async () => {
+      await client.publishJson(topic, {
+        s: sender,
+        b: [
+          { c: 'Bar', f: 'staticIncrement', a: [1], i: '1' },
+          { c: 'Bar', f: 'staticIncrement', a: [{ $ref: 0 }], i: '2' }
+        ]
+      })
+      const replies = await client.receiveJson(sender)
+      assert.deepStrictEqual(replies[1].a, [2])
+      assert.strictEqual(replies[1].r, 3)
+    })
+    it('should use an instance created in the same batch', async () => {
+      await client.publishJson(topic, {
+        s: sender,
+        b: [
+          { c: 'Bar', f: '__createShared__', a: ['refBar', 5], i: '1' },
+          { c: { $ref: 0 }, f: 'onValue', a: ['__f__onValue-1'], i: '2' },
+          { c: { $ref: 0 }, f: 'increment', a: [], i: '3' },
+          { c: 'Bar', f: '__delete__', a: [{ $ref: 0 }], i: '4' }
+        ]
+      })
+      // the callback of increment goes out before the batch is answered
+      const callback = await client.receiveJson(sender)
+      assert.strictEqual(callback.i, '__f__onValue-1')
+      assert.deepStrictEqual(callback.a, [6])
+      const replies = await client.receiveJson(sender)
+      assert.deepStrictEqual(
+        replies.map(({ r }) => r),
+        ['refBar', null, 6, true]
+      )
+    })
+    it('should fail entries referring to a failed entry', async () => {
+      await client.publishJson(topic, {
+        s: sender,
+        b: [
+          { c: 'Bar', f: 'doesNotExist', a: [], i: '1' },
+          { c: 'Bar', f: 'staticIncrement', a: [{ $ref: 0 }], i: '2' }
+        ]
+      })
+      const replies = await client.receiveJson(sender)
+      assert(replies[1].e.includes('failed'))
+      assert.strictEqual(replies[1].r, undefined)
+    })
+    it('should fail entries referring to later or unknown entries', async () => {
+      await client.publishJson(topic, {
+        s: sender,
+        b: [
+          { c: 'Bar', f: 'staticIncrement', a: [{ $ref: 1 }], i: '1' },
+          { c: 'Bar', f: 'staticIncrement', a: [{ $ref: -1 }], i: '2' }
+        ]
+      })
+      const replies = await client.receiveJson(sender)
+      assert(replies[0].e.includes('unknown call'))
+      assert(replies[1].e.includes('unknown call'))
+    })
+  })
+  /*****************
+   * one-way calls *
+   *****************/
+  describe('(7) one-way calls', () => {
+    const prefix = 'test.vrpc/agent2/Bar'
+    const sender = 'test.vrpc/client/oneWay'
+    const values = 'test.vrpc/client/oneWayValues'
+    const errors = 'test.vrpc/client/oneWayErrors'
+    let client
+    before(async () => {
+      client = new RawClient()
+      await client.connect()
+      await client.subscribe(sender)
+      await client.subscribe(values)
+      await client.subscribe(errors)
+      await client.publishJson(`${prefix}/__static__/__createShared__`, {
+        c: 'Bar',
+        f: '__createShared__',
+        a: ['oneWayBar'],
+        i: '1',
+        s: sender
+      })
+      await client.receiveJson(sender)
+      await client.publishJson(`${prefix}/oneWayBar/onValue`, {
+        c: 'oneWayBar',
+        f: 'onValue',
+        a: ['__f__onValue-1'],
+        i: '2',
+        s: values
+      })
+      await client.receiveJson(values)
+    })
+    after(async () => {
+      await client.publishJson(`${prefix}/__static__/__delete__`, {
+        c: 'Bar',
+        f: '__delete__',
+        a: ['oneWayBar'],
+        i: '3',
+        s: sender
+      })
+      await client.receiveJson(sender)
+      await client.end()
+    })
+    it('should execute one-way calls without answering them', async () => {
+      for (let i = 0; i < 2; ++i) {
+        await client.publishJson(`${prefix}/oneWayBar/increment`, {
+          c: 'oneWayBar',
+          f: 'increment',
+          a: [],
+          i: `oneWay${i}`,
+          s: sender,
+          o: true
+        })
+      }
+      await client.publishJson(`${prefix}/oneWayBar/increment`, {
+        c: 'oneWayBar',
+        f: 'increment',
+        a: [],
+        i: '4',
+        s: sender
+      })
+      const reply = await client.receiveJson(sender)
+      assert.strictEqual(reply.i, '4')
+      assert.strictEqual(reply.r, 3)
+    })
+    it('should publish errors of one-way calls to the given topic', async () => {
+      // no sender needed
+      await client.publishJson(`${prefix}/__static__/staticIncrement`, {
+        c: 'Bar',
+        f: 'staticIncrement',
+        a: ['notANumber'],
+        i: '5',
+        o: errors
+      })
+      const error = await client.receiveJson(errors)
+      assert.strictEqual(error.i, '5')
+      assert(error.e)
+      await assert.rejects(client.receive(sender, 300))
+    })
+    it('should refuse isolated instances without a sender', async () => {
+      await client.publishJson(`${prefix}/__static__/__createIsolated__`, {
+        c: 'Bar',
+        f: '__createIsolated__',
+        a: ['oneWayOrphan'],
+        i: '10',
+        o: errors
+      })
+      const error = await client.receiveJson(errors)
+      assert.strictEqual(error.i, '10')
+      assert(error.e.includes('"s"'))
+      await client.publishJson('test.vrpc/agent2/__batch__', {
+        o: errors,
+        b: [{ c: 'Bar', f: '__createIsolated__', a: ['oneWayOrphan'], i: '11' }]
+      })
+      const batchError = await client.receiveJson(errors)
+      assert.strictEqual(batchError.i, '11')
+      assert(batchError.e.includes('"s"'))
+    })
+    it('should only report the failed entries of a one-way batch', async () => {
+      await client.publishJson('test.vrpc/agent2/__batch__', {
+        o: errors,
+        b: [
+          { c: 'Bar', f: 'staticIncrement', a: [1], i: '6' },
+          { c: 'Bar', f: 'doesNotExist', a: [], i: '7' }
+        ]
+      })
+      const error = await client.receiveJson(errors)
+      assert.strictEqual(error.i, '7')
+      assert(error.e)
+      await assert.rejects(client.receive(errors, 300))
+    })
+    it('should drop regular calls without a sender', async () => {
+      await client.publishJson(`${prefix}/__static__/staticIncrement`, {
+        c: 'Bar',
+        f: 'staticIncrement',
+        a: [1],
+        i: '8'
+      })
+      await client.publishJson(`${prefix}/__static__/staticIncrement`, {
+        c: 'Bar',
+        f: 'staticIncrement',
+        a: [2],
+        i: '9',
+        s: sender
+      })
+      const reply = await client.receiveJson(sender)
+      assert.strictEqual(reply.i, '9')
+      assert.strictEqual(reply.r, 3)
+    })
+  })
+  /****************************
+   * MQTT v5 request/response *
+   ****************************/
+  describe('(8) MQTT v5 request/response', () => {
+    const prefix = 'test.vrpc.ext/agent3/Echo'
+    const responses = 'test.vrpc.ext/client/v5/responses'
+    let client
+
+    const call = async (topic, args, properties = {}) => {
+      const correlationData = Buffer.from(Math.random().toString(16))
+      await client.publish(topic, JSON.stringify(args), {
+        properties: { responseTopic: responses, correlationData, ...properties }
+      })
+      const response = await client.receive(responses)
+      assert(response.properties.correlationData.equals(correlationData))
+      return response
+    }
+
+    before(async () => {
+      client = new RawClient({ protocolVersion: 5 })
+      await client.connect()
+      await client.subscribe(responses)
+    })
+    after(async () => {
+      await client.end()
+    })
+    it('should answer to the response topic with the correlation data', async () => {
+      const { payload } = await call(`${prefix}/__static__/repeat`, ['ab', 2])
+      assert.strictEqual(JSON.parse(payload.toString()), 'abab')
+    })
+    it('should tie isolated instances to the client given as "s"', async () => {
+      const client = { userProperties: { s: 'test.vrpc.ext/client/v5' } }
+      const created = await call(
+        `${prefix}/__static__/__createIsolated__`,
+        ['v5Echo'],
+        client
+      )
+      assert.strictEqual(JSON.parse(created.payload.toString()), 'v5Echo')
+      const echoed = await call(`${prefix}/v5Echo/echo`, ['hello'])
+      assert.strictEqual(JSON.parse(echoed.payload.toString()), 'hello')
+      const deleted = await call(
+        `${prefix}/__static__/__delete__`,
+        ['v5Echo'],
+        client
+      )
+      assert.strictEqual(JSON.parse(deleted.payload.toString()), true)
+    })
+    it('should send large responses in chunks', async () => {
+      const correlationData = Buffer.from('chunked')
+      await client.publish(`${prefix}/__static__/repeat`, '["v5", 1000]', {
+        properties: { responseTopic: responses, correlationData }
+      })
+      const chunks = []
+      let total = 1
+      while (chunks.length < total) {
+        const { payload, properties } = await client.receive(responses)
+        assert(properties.correlationData.equals(correlationData))
+        assert(payload.length < 1024)
+        chunks[payload.readUInt32LE(12)] = payload.slice(20)
+        total = payload.readUInt32LE(16)
+      }
+      assert(total > 1)
+      assert.strictEqual(
+        JSON.parse(Buffer.concat(chunks).toString()),
+        'v5'.repeat(1000)
+      )
+    })
+    it('should refuse isolated instances without a client', async () => {
+      const { payload, properties } = await call(
+        `${prefix}/__static__/__createIsolated__`,
+        ['orphan']
+      )
+      assert.strictEqual(payload.length, 0)
+      assert(properties.userProperties.e.includes('"s"'))
+    })
+    it('should answer errors as user property', async () => {
+      const { payload, properties } = await call(`${prefix}/__static__/repeat`, [
+        'ab',
+        'twice'
+      ])
+      assert.strictEqual(payload.length, 0)
+      assert(properties.userProperties.e)
+    })
+    it('should reject arguments other than an array', async () => {
+      const { properties } = await call(`${prefix}/__static__/repeat`, {
+        text: 'ab'
+      })
+      assert(properties.userProperties.e.startsWith('Invalid arguments'))
+    })
+  })
+  /******************
+   * ring transport *
+   ******************/
+  describe('(9) ring transport', () => {
+    const prefix = 'test.vrpc.ext/agent3'
+    const sender = 'test.vrpc.ext/client/ring'
+    // layout of <vrpc/ring.hpp> for rings of the minimal capacity
+    const capacity = 4096
+    const channelHeader = 64
+    const ringHeader = 192
+    const requestRing = channelHeader
+    const replyRing = channelHeader + ringHeader + capacity
+    let client
+    let info
+
+    const readUInt64 = (fd, position) => {
+      const buffer = Buffer.alloc(8)
+      fs.readSync(fd, buffer, 0, 8, position)
+      return Number(buffer.readBigUInt64LE())
+    }
+    const writeUInt64 = (fd, position, value) => {
+      const buffer = Buffer.alloc(8)
+      buffer.writeBigUInt64LE(BigInt(value))
+      fs.writeSync(fd, buffer, 0, 8, position)
+    }
+    // positions stay within the first lap, no wrapping needed
+    const writeMessage = (fd, payload) => {
+      const tail = readUInt64(fd, requestRing + 64)
+      const length = Buffer.alloc(4)
+      length.writeUInt32LE(payload.length)
+      const data = requestRing + ringHeader + tail
+      const message = Buffer.concat([length, payload])
+      fs.writeSync(fd, message, 0, message.length, data)
+      writeUInt64(fd, requestRing + 64, tail + 4 + payload.length)
+    }
+    // the agent is not woken up (no futex), it looks at least once a second
+    const readMessage = async (fd, timeout = 3000) => {
+      const until = Date.now() + timeout
+      while (Date.now() < until) {
+        const head = readUInt64(fd, replyRing)
+        if (readUInt64(fd, replyRing + 64) > head) {
+          const data = replyRing + ringHeader + head
+          const length = Buffer.alloc(4)
+          fs.readSync(fd, length, 0, 4, data)
+          const payload = Buffer.alloc(length.readUInt32LE())
+          fs.readSync(fd, payload, 0, payload.length, data + 4)
+          writeUInt64(fd, replyRing, head + 4 + payload.length)
+          return payload
+        }
+        await new Promise(resolve => setTimeout(resolve, 10))
+      }
+      throw new Error('Nothing received through the ring')
+    }
+    // the agent creates the channel, we open it by the path it answers
+    const requestChannel = async (request) => {
+      await client.publishJson(`${prefix}/__ring__`, {
+        s: sender,
+        p: process.pid,
+        ...request
+      })
+      return client.receiveJson(sender)
+    }
+    const openChannel = async () => {
+      const reply = await requestChannel({ i: 'ring' })
+      assert.strictEqual(reply.i, 'ring')
+      return fs.openSync(reply.r, 'r+')
+    }
+    const closeChannel = (fd) => {
+      const closed = Buffer.alloc(4)
+      closed.writeUInt32LE(1)
+      fs.writeSync(fd, closed, 0, 4, 12)
+      fs.closeSync(fd)
+    }
+    const isClosed = (fd) => {
+      const closed = Buffer.alloc(4)
+      fs.readSync(fd, closed, 0, 4, 12)
+      return closed.readUInt32LE() !== 0
+    }
+
+    before(async () => {
+      client = new RawClient()
+      await client.connect()
+      await client.subscribe(sender)
+      await client.subscribe(`${prefix}/__agentInfo__`)
+      info = await client.receiveJson(`${prefix}/__agentInfo__`)
+    })
+    after(async () => {
+      await client.end()
+    })
+    it('should announce the ring transport', () => {
+      assert.strictEqual(info.ring, true)
+    })
+    it('should answer calls through a ring channel', async () => {
+      const fd = await openChannel()
+      try {
+        writeMessage(
+          fd,
+          Buffer.from(
+            JSON.stringify({ c: 'Echo', f: 'repeat', a: ['ri', 2], i: '1' })
+          )
+        )
+        const reply = JSON.parse((await readMessage(fd)).toString())
+        assert.strictEqual(reply.i, '1')
+        assert.strictEqual(reply.r, 'riri')
+        // the agent would fault accessing truncated memory
+        assert.throws(() => fs.ftruncateSync(fd, channelHeader))
+        assert.throws(() => fs.ftruncateSync(fd, 2 * capacity))
+      } finally {
+        closeChannel(fd)
+      }
+    })
+    it('should refuse isolated instances for frames without a sender', async () => {
+      const fd = await openChannel()
+      try {
+        writeMessage(
+          fd,
+          Buffer.from(
+            JSON.stringify({
+              c: 'Echo',
+              f: '__createIsolated__',
+              a: ['ringOrphan'],
+              i: '1'
+            })
+          )
+        )
+        const reply = JSON.parse((await readMessage(fd)).toString())
+        assert.strictEqual(reply.i, '1')
+        assert(reply.e.includes('"s"'))
+        assert.strictEqual(reply.r, undefined)
+      } finally {
+        closeChannel(fd)
+      }
+    })
+    it('should refuse invalid channel requests', async () => {
+      const noProcess = await requestChannel({ i: '1', p: 0 })
+      assert.strictEqual(noProcess.i, '1')
+      assert(noProcess.e)
+      assert.strictEqual(noProcess.r, undefined)
+      const tooLarge = await requestChannel({ i: '2', k: 1024 * 1024 * 1024 })
+      assert.strictEqual(tooLarge.i, '2')
+      assert(tooLarge.e)
+    })
+    it('should close channels with corrupt lengths and keep serving', async () => {
+      const fd = await openChannel()
+      try {
+        const length = Buffer.alloc(4)
+        length.writeUInt32LE(100000)
+        fs.writeSync(fd, length, 0, 4, requestRing + ringHeader)
+        writeUInt64(fd, requestRing + 64, 8)
+        const until = Date.now() + 3000
+        while (!isClosed(fd) && Date.now() < until) {
+          await new Promise(resolve => setTimeout(resolve, 10))
+        }
+        assert(isClosed(fd))
+      } finally {
+        fs.closeSync(fd)
+      }
+      await client.publishJson(`${prefix}/Echo/__static__/repeat`, {
+        c: 'Echo',
+        f: 'repeat',
+        a: ['ok', 1],
+        i: '2',
+        s: sender
+      })
+      const reply = await client.receiveJson(sender)
+      assert.strictEqual(reply.r, 'ok')
+    })
+  })
+  /*********************
+   * batches in a pool *
+   *********************/
+  describe('(10) batches in a pool', () => {
+    const topic = 'test.vrpc.ext/pooled/__batch__'
+    const sender = 'test.vrpc.ext/client/pooled'
+    let client
+    before(async () => {
+      client = new RawClient()
+      await client.connect()
+      await client.subscribe(sender)
+    })
+    after(async () => {
+      await client.end()
+    })
+    it('should answer each batch by a single member', async () => {
+      for (let i = 0; i < 4; ++i) {
+        await client.publishJson(topic, {
+          s: sender,
+          b: [{ c: 'Echo', f: 'repeat', a: ['p', i], i: `${i}` }]
+        })
+      }
+      const replies = []
+      for (let i = 0; i < 4; ++i) replies.push(await client.receiveJson(sender))
+      assert.deepStrictEqual(
+        replies.map(([{ i, r }]) => [i, r]).sort(),
+        [
+          ['0', ''],
+          ['1', 'p'],
+          ['2', 'pp'],
+          ['3', 'ppp']
+        ]
+      )
+      await assert.rejects(client.receive(sender, 300))
+    })
+    it('should fail batched instance and lifetime calls', async () => {
+      await client.publishJson(topic, {
+        s: sender,
+        b: [
+          { c: 'Echo', f: '__createShared__', a: ['pooledEcho'], i: '1' },
+          { c: 'pooledEcho', f: 'echo', a: ['hi'], i: '2' },
+          { c: 'Echo', f: 'repeat', a: ['ok', 1], i: '3' }
+        ]
+      })
+      const replies = await client.receiveJson(sender)
+      const error = 'Batches of a pool take static functions only'
+      assert.strictEqual(replies[0].e, error)
+      assert.strictEqual(replies[0].r, undefined)
+      assert.strictEqual(replies[1].e, error)
+      assert.strictEqual(replies[2].r, 'ok')
+    })
+  })
+  /*****************
+   * raw functions *
+   *****************/
+  describe('(11) raw functions', () => {
+    const topic = 'test.vrpc.ext/agent3/Echo/__static__/reverse'
+    const responses = 'test.vrpc.ext/client/raw/responses'
+    // not valid utf-8, let alone json
+    const bytes = Buffer.from([0x00, 0xff, 0x7b, 0x01, 0xfe])
+    let client
+    let client5
+    before(async () => {
+      client = new RawClient()
+      await client.connect()
+      await client.subscribe(`${topic}/__raw__`)
+      client5 = new RawClient({ protocolVersion: 5 })
+      await client5.connect()
+      await client5.subscribe(responses)
+    })
+    after(async () => {
+      await client.end()
+      await client5.end()
+    })
+    it('should publish the plain result next to the request topic', async () => {
+      await client.publish(topic, bytes)
+      const { payload } = await client.receive(`${topic}/__raw__`)
+      assert(payload.equals(Buffer.from(bytes).reverse()))
+    })
+    it('should drop failed calls and keep serving', async () => {
+      await client.publish(topic, Buffer.alloc(0))
+      await assert.rejects(client.receive(`${topic}/__raw__`, 300))
+      await client.publish(topic, 'ab')
+      const { payload } = await client.receive(`${topic}/__raw__`)
+      assert.strictEqual(payload.toString(), 'ba')
+    })
+    it('should answer v5 requests to the response topic', async () => {
+      const correlationData = Buffer.from('raw')
+      await client5.publish(topic, bytes, {
+        properties: { responseTopic: responses, correlationData }
+      })
+      const { payload, properties } = await client5.receive(responses)
+      assert(properties.correlationData.equals(correlationData))
+      assert(payload.equals(Buffer.from(bytes).reverse()))
+      assert.strictEqual(properties.userProperties, undefined)
+    })
+    it('should answer errors of v5 requests as user property', async () => {
+      await client5.publish(topic, Buffer.alloc(0), {
+        properties: { responseTopic: responses }
+      })
+      const { payload, properties } = await client5.receive(responses)
+      assert.strictEqual(payload.length, 0)
+      assert.strictEqual(properties.userProperties.e, 'Nothing to reverse')
+    })
+  })
+  /***********************
+   * payload compression *
+   ***********************/
+  describe('(12) payload compression', () => {
+    const prefix = 'test.vrpc.ext/agent3'
+    const topic = `${prefix}/Echo/__static__/repeat`
+    const sender = 'test.vrpc.ext/client/lz4'
+    let client
+
+    // LZ4 block of text repeating pattern times, framed as the agent expects
+    const compress = (prefix, pattern, times, suffix) => {
+      const lengthBytes = (n) => {
+        const bytes = []
+        for (; n >= 255; n -= 255) bytes.push(255)
+        bytes.push(n)
+        return Buffer.from(bytes)
+      }
+      // a single match repeats the pattern, the suffix ends the block
+      const literals = Buffer.from(prefix + pattern)
+      const match = (times - 1) * pattern.length - 4
+      const last = Buffer.from(suffix)
+      const offset = Buffer.alloc(2)
+      offset.writeUInt16LE(pattern.length)
+      const block = Buffer.concat([
+        Buffer.from([(15 << 4) | 15]),
+        lengthBytes(literals.length - 15),
+        literals,
+        offset,
+        lengthBytes(match - 15),
+        Buffer.from([Math.min(last.length, 15) << 4]),
+        last.length >= 15 ? lengthBytes(last.length - 15) : Buffer.alloc(0),
+        last
+      ])
+      const header = Buffer.alloc(8)
+      header.write('VLZ4')
+      header.writeUInt32LE(
+        prefix.length + pattern.length * times + suffix.length,
+        4
+      )
+      return Buffer.concat([header, block])
+    }
+    const decompress = (payload) => {
+      assert.strictEqual(payload.slice(0, 4).toString(), 'VLZ4')
+      const block = payload.slice(8)
+      const out = Buffer.alloc(payload.readUInt32LE(4))
+      let i = 0
+      let o = 0
+      const length = (n) => {
+        if (n < 15) return n
+        for (let b = 255; b === 255; n += b) b = block[i++]
+        return n
+      }
+      while (i < block.length) {
+        const token = block[i++]
+        const literals = length(token >> 4)
+        block.copy(out, o, i, i + literals)
+        i += literals
+        o += literals
+        if (i === block.length) break
+        const offset = block.readUInt16LE(i)
+        i += 2
+        for (let n = length(token & 15) + 4; n > 0; --n, ++o) {
+          out[o] = out[o - offset]
+        }
+      }
+      assert.strictEqual(o, out.length)
+      return JSON.parse(out.toString())
+    }
+
+    before(async () => {
+      client = new RawClient()
+      await client.connect()
+      await client.subscribe(sender)
+      await client.subscribe(`${prefix}/__agentInfo__`)
+    })
+    after(async () => {
+      await client.end()
+    })
+    it('should announce lz4 compression', async () => {
+      const info = await client.receiveJson(`${prefix}/__agentInfo__`)
+      assert.strictEqual(info.compression, 'lz4')
+    })
+    it('should compress large replies if asked to', async () => {
+      await client.publishJson(topic, {
+        c: 'Echo',
+        f: 'repeat',
+        a: ['lz4', 2000],
+        i: '1',
+        s: sender,
+        z: 'lz4'
+      })
+      const { payload } = await client.receive(sender)
+      assert(payload.length < 1000)
+      const reply = decompress(payload)
+      assert.strictEqual(reply.i, '1')
+      assert.strictEqual(reply.r, 'lz4'.repeat(2000))
+    })
+    it('should send small replies uncompressed', async () => {
+      await client.publishJson(topic, {
+        c: 'Echo',
+        f: 'repeat',
+        a: ['lz4', 2],
+        i: '2',
+        s: sender,
+        z: 'lz4'
+      })
+      const reply = await client.receiveJson(sender)
+      assert.strictEqual(reply.r, 'lz4lz4')
+    })
+    it('should take compressed requests and answer them compressed', async () => {
+      const request = compress(
+        '{"c":"Echo","f":"repeat","a":["',
+        'zip',
+        3000,
+        `",1],"i":"3","s":"${sender}"}`
+      )
+      assert(request.length < 200)
+      await client.publish(topic, request)
+      const { payload } = await client.receive(sender)
+      const reply = decompress(payload)
+      assert.strictEqual(reply.i, '3')
+      assert.strictEqual(reply.r, 'zip'.repeat(3000))
+    })
+    it('should drop malformed blocks and keep serving', async () => {
+      const request = compress(
+        '{"c":"Echo","f":"repeat","a":["',
+        'bad',
+        100,
+        `",1],"i":"4","s":"${sender}"}`
+      )
+      // the match refers to data before the start of the block
+      request.writeUInt16LE(60000, request.indexOf('["bad') + 5)
+      await client.publish(topic, request)
+      await assert.rejects(client.receive(sender, 300))
+      await client.publishJson(topic, {
+        c: 'Echo',
+        f: 'repeat',
+        a: ['ok', 1],
+        i: '5',
+        s: sender
+      })
+      const reply = await client.receiveJson(sender)
+      assert.strictEqual(reply.i, '5')
+    })
+  })
+  /**************************
+   * wildcard subscriptions *
+   **************************/
+  describe('(13) wildcard subscriptions', () => {
+    const prefix = 'test.vrpc.ext/agent3/Echo'
+    const sender = 'test.vrpc.ext/client/wildcard'
+    const responses = 'test.vrpc.ext/client/wildcard/responses'
+    let client
+
+    const call = async (topic, envelope) => {
+      await client.publishJson(topic, { a: [], i: '1', s: sender, ...envelope })
+      return client.receiveJson(sender)
+    }
+
+    before(async () => {
+      client = new RawClient()
+      await client.connect()
+      await client.subscribe(sender)
+    })
+    after(async () => {
+      await client.end()
+    })
+    it('should route calls to static functions and instances', async () => {
+      const created = await call(`${prefix}/__static__/__createShared__`, {
+        c: 'Echo',
+        f: '__createShared__',
+        a: ['wildEcho']
+      })
+      assert.strictEqual(created.r, 'wildEcho')
+      const echoed = await call(`${prefix}/wildEcho/echo`, {
+        c: 'wildEcho',
+        f: 'echo',
+        a: ['wild']
+      })
+      assert.strictEqual(echoed.r, 'wild')
+      const deleted = await call(`${prefix}/__static__/__delete__`, {
+        c: 'Echo',
+        f: '__delete__',
+        a: ['wildEcho']
+      })
+      assert.strictEqual(deleted.r, true)
+      const repeated = await call(`${prefix}/__static__/repeat`, {
+        c: 'Echo',
+        f: 'repeat',
+        a: ['w', 3]
+      })
+      assert.strictEqual(repeated.r, 'www')
+    })
+    it('should answer calls to unknown targets with an error', async () => {
+      const klass = await call('test.vrpc.ext/agent3/Nope/__static__/repeat', {
+        c: 'Nope',
+        f: 'repeat'
+      })
+      assert.strictEqual(klass.e, 'Could not find class: Nope')
+      const instance = await call(`${prefix}/wildEcho/echo`, {
+        c: 'wildEcho',
+        f: 'echo',
+        a: ['gone']
+      })
+      assert.strictEqual(instance.e, 'Could not find instance: wildEcho')
+      const func = await call(`${prefix}/__static__/nope`, {
+        c: 'Echo',
+        f: 'nope'
+      })
+      assert.strictEqual(func.e, 'Could not find function: nope')
+    })
+    it('should answer v5 calls to unknown targets with an error', async () => {
+      const client5 = new RawClient({ protocolVersion: 5 })
+      await client5.connect()
+      try {
+        await client5.subscribe(responses)
+        await client5.publish(`${prefix}/wildEcho/echo`, '["gone"]', {
+          properties: { responseTopic: responses }
+        })
+        const { properties } = await client5.receive(responses)
+        assert.strictEqual(
+          properties.userProperties.e,
+          'Could not find instance: wildEcho'
+        )
+      } finally {
+        await client5.end()
+      }
+    })
+  })
+  /******************
+   * reply grouping *
+   ******************/
+  describe('(14) reply grouping', () => {
+    const prefix = 'test.vrpc.ext/agent3'
+    const sender = 'test.vrpc.ext/client/grouping'
+    let client
+
+    // Sends count grouped calls at once, resolves with the messages received
+    // until every call is answered
+    const burst = async (count) => {
+      for (let i = 0; i < count; ++i) {
+        await client.publishJson(`${prefix}/Echo/__static__/repeat`, {
+          c: 'Echo',
+          f: 'repeat',
+          a: ['g', i],
+          i: `g${i}`,
+          s: sender,
+          g: true
+        })
+      }
+      const messages = []
+      const replies = {}
+      while (Object.keys(replies).length < count) {
+        const message = await client.receiveJson(sender)
+        messages.push(message)
+        for (const reply of [].concat(message)) {
+          assert(!replies[reply.i], `${reply.i} answered twice`)
+          replies[reply.i] = reply
+        }
+      }
+      return { messages, replies }
+    }
+
+    before(async () => {
+      client = new RawClient()
+      await client.connect()
+      await client.subscribe(sender)
+      await client.subscribe(`${prefix}/__agentInfo__`)
+    })
+    after(async () => {
+      await client.end()
+    })
+    it('should announce reply grouping', async () => {
+      const info = await client.receiveJson(`${prefix}/__agentInfo__`)
+      assert.strictEqual(info.coalescing, true)
+    })
+    it('should answer every grouped call with its own reply', async () => {
+      const { messages, replies } = await burst(20)
+      for (let i = 0; i < 20; ++i) {
+        assert.strictEqual(replies[`g${i}`].r, 'g'.repeat(i))
+      }
+      // a burst leaves in fewer messages than calls
+      assert(messages.length < 20)
+      assert(messages.some(message => Array.isArray(message)))
+      await assert.rejects(client.receive(sender, 300))
+    })
+    it('should answer single calls right away and ungrouped', async () => {
+      await new Promise(resolve => setTimeout(resolve, 100))
+      const start = Date.now()
+      const { messages, replies } = await burst(1)
+      assert(Date.now() - start < 1000)
+      assert.strictEqual(messages.length, 1)
+      assert(!Array.isArray(messages[0]))
+      assert.strictEqual(replies.g0.r, '')
+    })
+  })
+  /******************************
+   * backpressure and reconnect *
+   ******************************/
+  describe('(15) backpressure and reconnect', () => {
+    const prefix = 'test.vrpc.ext/flow'
+    const sender = 'test.vrpc.ext/client/flow'
+    const probe = 'test.vrpc.ext/client/flow/probe'
+    const connections = new Set()
+    let proxy
+    let client
+
+    // Passes the agent's connection on to the broker
+    const startProxy = () => {
+      proxy = net.createServer(agent => {
+        const broker = net.connect(1883, 'broker')
+        agent.pipe(broker).pipe(agent)
+        for (const socket of [agent, broker]) {
+          connections.add(socket)
+          socket.on('error', () => {})
+          socket.on('close', () => {
+            connections.delete(socket)
+            agent.destroy()
+            broker.destroy()
+          })
+        }
+      })
+      return new Promise(resolve => proxy.listen(1884, resolve))
+    }
+    const online = async () => {
+      for (;;) {
+        const info = await client.receiveJson(`${prefix}/__agentInfo__`, 5000)
+        if (info.status === 'online') return
+      }
+    }
+    // The agent reports the bytes waiting to be sent until they were written
+    const settled = async () => {
+      for (let i = 0; i < 40; ++i) {
+        await client.publishJson(`${prefix}/Probe/__static__/pendingBytes`, {
+          c: 'Probe',
+          f: 'pendingBytes',
+          a: [],
+          i: `${i}`,
+          s: probe
+        })
+        const { r } = await client.receiveJson(probe)
+        if (r === 0) return r
+        await new Promise(resolve => setTimeout(resolve, 50))
+      }
+      throw new Error('Bytes remain pending')
+    }
+    // More replies than may be pending at once (4096 bytes), each one below the packet size
+    const burst = async (id, count) => {
+      for (let i = 0; i < count; ++i) {
+        await client.publishJson(`${prefix}/Echo/__static__/repeat`, {
+          c: 'Echo',
+          f: 'repeat',
+          a: ['x', 600],
+          i: `${id}${i}`,
+          s: sender
+        })
+      }
+    }
+
+    before(async () => {
+      client = new RawClient()
+      await client.connect()
+      await client.subscribe(sender)
+      await client.subscribe(probe)
+      await client.subscribe(`${prefix}/__agentInfo__`)
+      await startProxy()
+      await online()
+    })
+    after(async () => {
+      await client.end()
+      proxy.close()
+      for (const socket of connections) socket.destroy()
+    })
+    it('should write all pending bytes after a burst of replies', async () => {
+      await burst('a', 40)
+      for (let i = 0; i < 40; ++i) {
+        const reply = await client.receiveJson(sender)
+        assert.strictEqual(reply.r.length, 600)
+      }
+      assert.strictEqual(await settled(), 0)
+    })
+    it('should not count bytes lost with the connection', async () => {
+      await burst('b', 40)
+      // cut the agent off while replies are on their way
+      await client.receive(sender)
+      for (const socket of connections) socket.destroy()
+      await online()
+      assert.strictEqual(await settled(), 0)
+      // and it keeps accepting calls
+      client._messages = []
+      await burst('c', 10)
+      const ids = []
+      for (let i = 0; i < 10; ++i) ids.push((await client.receiveJson(sender)).i)
+      assert.deepStrictEqual(ids.sort(), [...Array(10).keys()].map(i => `c${i}`).sort())
+    })
+  })
 })
@@ -26,6 +26,7 @@ trap 'cleanup ; printf "${RED}Tests Failed For Unexpected Reasons${NC}\n"'\
 # copy the current vrpc headers into the fixtures
 cp -rf ../../vrpc fixtures/agent1/
 cp -rf ../../vrpc fixtures/agent2/
+cp -rf ../../vrpc fixtures/agent3/
 
 # run the composed services
 docker-compose build && docker-compose -p ${PROJECT} up -d
@@ -45,6 +45,9 @@ SOFTWARE.
 #define VRPC_VERSION_MINOR 0
 #define VRPC_VERSION_PATCH 0
 
+// Signature suffix marking functions that bypass json
+#define VRPC_RAW_SIGNATURE "-raw"
+
 #include <cstdint>
 #include <functional>
 #include <iostream>
@@ -52,6 +55,7 @@ SOFTWARE.
 #include <memory>
 #include <set>
 #include <sstream>
+#include <stdexcept>
 #include <tuple>
 #include <type_traits>
 #include <typeindex>
@@ -586,12 +590,20 @@ class Function {
 
   void call_function(json& json) { this->do_call_function(json); }
 
+  std::string call_raw(const char* data, std::size_t size) {
+    return this->do_call_raw(data, size);
+  }
+
   std::shared_ptr<Function> clone() { return this->do_clone(); }
 
  protected:
   virtual void do_bind_instance(const Value& instance) = 0;
   virtual void do_call_function(json& json) = 0;
   virtual std::shared_ptr<Function> do_clone() = 0;
+
+  virtual std::string do_call_raw(const char*, std::size_t) {
+    throw std::runtime_error("Function does not accept raw payloads");
+  }
 };
 
 template <typename Klass, typename Lambda, typename Ret, typename... Args>
@@ -733,6 +745,85 @@ class ConstructorFunction : public Function {
   }
 };
 
+namespace detail {
+
+template <typename Ret>
+struct raw_call {
+  template <typename F, typename A>
+  static std::string call(const F& f, A&& a) {
+    return std::string(f(std::forward<A>(a)));
+  }
+};
+
+template <>
+struct raw_call<void> {
+  template <typename F, typename A>
+  static std::string call(const F& f, A&& a) {
+    f(std::forward<A>(a));
+    return std::string();
+  }
+};
+}  // namespace detail
+
+/**
+ * Function receiving the plain message payload.
+ *
+ * Raw functions bypass json entirely: the payload is handed over as Arg (any
+ * type constructible from a pointer and a size, e.g. a string_view) and the
+ * returned bytes are published as they are.
+ */
+template <typename Klass, typename Func, Func f, typename Ret, typename Arg>
+class RawMemberFunction : public Function {
+  std::shared_ptr<Klass> _ptr;
+
+ public:
+  virtual ~RawMemberFunction() = default;
+
+  virtual std::shared_ptr<Function> do_clone() {
+    auto ptr = std::make_shared<RawMemberFunction>();
+    return std::static_pointer_cast<Function>(ptr);
+  }
+
+  virtual void do_call_function(json& json) {
+    json["e"] = "Raw function can not be called with json arguments";
+  }
+
+  virtual std::string do_call_raw(const char* data, std::size_t size) {
+    Klass* ptr = _ptr.get();
+    return detail::raw_call<Ret>::call(
+        [ptr](detail::no_ref_no_const<Arg>&& a) { return (ptr->*f)(a); },
+        detail::no_ref_no_const<Arg>(data, size));
+  }
+
+  virtual void do_bind_instance(const Value& instance) {
+    _ptr = instance.get<std::shared_ptr<Klass>>();
+  }
+};
+
+template <typename Func, Func f, typename Ret, typename Arg>
+class RawStaticFunction : public Function {
+ public:
+  virtual ~RawStaticFunction() = default;
+
+  virtual std::shared_ptr<Function> do_clone() {
+    auto ptr = std::make_shared<RawStaticFunction>();
+    return std::static_pointer_cast<Function>(ptr);
+  }
+
+  virtual void do_call_function(json& json) {
+    json["e"] = "Raw function can not be called with json arguments";
+  }
+
+  virtual std::string do_call_raw(const char* data, std::size_t size) {
+    return detail::raw_call<Ret>::call(f,
+                                       detail::no_ref_no_const<Arg>(data, size));
+  }
+
+  virtual void do_bind_instance(const Value&) {
+    // Nothing to bind, static function
+  }
+};
+
 struct required {};
 
 namespace detail {
@@ -795,6 +886,10 @@ class LocalFactory {
   FunctionRegistry _class_function_registry;
   // Maps: instanceId => function_name => functionCallback
   FunctionRegistry _function_registry;
+  // Maps: class_name => raw function_name (without signature) => unbound
+  FunctionRegistry _class_raw_function_registry;
+  // Maps: instanceId => raw function_name (without signature) => callback
+  FunctionRegistry _raw_function_registry;
   // Maps: instanceId => instanceObj
   StringAnyMap _instances;
   // Maps: instanceId => class_name
@@ -842,6 +937,37 @@ class LocalFactory {
                 << std::endl;
   }
 
+  template <typename Klass,
+            typename Func,
+            Func f,
+            typename Ret,
+            typename Arg>
+  static void register_raw_member_function(const std::string& class_name,
+                                           const std::string& function_name) {
+    auto funcT = std::make_shared<RawMemberFunction<Klass, Func, f, Ret, Arg>>();
+    LocalFactory& rf = detail::init<LocalFactory>();
+    rf._class_function_registry[class_name][function_name +
+                                            VRPC_RAW_SIGNATURE] =
+        std::static_pointer_cast<Function>(funcT);
+    rf._class_raw_function_registry[class_name][function_name] =
+        std::static_pointer_cast<Function>(funcT);
+    _VRPC_DEBUG << "Registered: " << class_name << "::" << function_name
+                << VRPC_RAW_SIGNATURE << std::endl;
+  }
+
+  template <typename Func, Func f, typename Ret, typename Arg>
+  static void register_raw_static_function(const std::string& class_name,
+                                           const std::string& function_name) {
+    auto funcT = std::make_shared<RawStaticFunction<Func, f, Ret, Arg>>();
+    LocalFactory& rf = detail::init<LocalFactory>();
+    rf._function_registry[class_name][function_name + VRPC_RAW_SIGNATURE] =
+        std::static_pointer_cast<Function>(funcT);
+    rf._raw_function_registry[class_name][function_name] =
+        std::static_pointer_cast<Function>(funcT);
+    _VRPC_DEBUG << "Registered: " << class_name << "::" << function_name
+                << VRPC_RAW_SIGNATURE << std::endl;
+  }
+
   static void register_meta_data(const std::string& class_name,
                                  const std::string& function_name,
                                  const std::string& description,
@@ -929,6 +1055,25 @@ class LocalFactory {
     json["e"] = "Could not find context: " + context;
   }
 
+  /**
+   * Calls a raw function (if existing) with the plain message payload.
+   *
+   * @return false if context has no raw function with the given name
+   */
+  static bool call_raw(const std::string& context,
+                       const std::string& function,
+                       const char* data,
+                       std::size_t size,
+                       std::string& result) {
+    auto& registry = detail::init<LocalFactory>()._raw_function_registry;
+    auto it_t = registry.find(context);
+    if (it_t == registry.end()) return false;
+    auto it_f = it_t->second.find(function);
+    if (it_f == it_t->second.end()) return false;
+    result = it_f->second->call_raw(data, size);
+    return true;
+  }
+
   static void load_bindings(const std::string& path) {
 #if defined(VRPC_WITH_DL) && !defined(_WIN32)
     void* libHandle = dlopen(path.c_str(), RTLD_LAZY);
@@ -971,6 +1116,7 @@ class LocalFactory {
         functionCallback->bind_instance(ptr);
         rf._function_registry[instance_id][i.first] = functionCallback;
       }
+      rf.bind_raw_functions(class_name, instance_id);
       // Keep instance alive by saving the shared_ptr
       rf._instances[instance_id] = Value(ptr);
       return instance_id;
@@ -1000,6 +1146,7 @@ class LocalFactory {
         functionCallback->bind_instance(ptr);
         rf._function_registry[instance_id][i.first] = functionCallback;
       }
+      rf.bind_raw_functions(class_name, instance_id);
       // Keep instance alive by saving the shared_ptr
       rf._instances[instance_id] = Value(ptr);
       // Store shared instance
@@ -1016,6 +1163,18 @@ class LocalFactory {
                 << std::endl;
   }
 
+  // Raw functions of an instance, looked up without their signature
+  void bind_raw_functions(const std::string& class_name,
+                          const std::string& instance_id) {
+    const auto it = _class_raw_function_registry.find(class_name);
+    if (it == _class_raw_function_registry.end()) return;
+    StringFunctionMap& functions = _function_registry[instance_id];
+    for (const auto& i : it->second) {
+      _raw_function_registry[instance_id][i.first] =
+          functions[i.first + VRPC_RAW_SIGNATURE];
+    }
+  }
+
   template <typename Klass>
   static void inject_delete_function(const std::string& class_name) {
     auto func = [=](const std::string& instance_id) {
@@ -1024,6 +1183,7 @@ class LocalFactory {
       if (it == rf._instances.end())
         return false;
       rf._function_registry.erase(instance_id);
+      rf._raw_function_registry.erase(instance_id);
       rf._instances.erase(instance_id);
       rf._shared_instances.erase(instance_id);
       return true;
@@ -1158,6 +1318,34 @@ template <typename Func, Func f, typename Ret, typename... Args>
 struct RegisterStaticFunctionX {
   static const StaticFunctionXRegistrar<Func, f, Ret, Args...> registerAs;
 };
+
+template <class Klass, typename Func, Func f, typename Ret, typename Arg>
+struct RawMemberFunctionRegistrar {
+  RawMemberFunctionRegistrar(const std::string& class_name,
+                             const std::string& function_name) {
+    LocalFactory::register_raw_member_function<Klass, Func, f, Ret, Arg>(
+        class_name, function_name);
+  }
+};
+
+template <class Klass, typename Func, Func f, typename Ret, typename Arg>
+struct RegisterRawMemberFunction {
+  static const RawMemberFunctionRegistrar<Klass, Func, f, Ret, Arg> registerAs;
+};
+
+template <typename Func, Func f, typename Ret, typename Arg>
+struct RawStaticFunctionRegistrar {
+  RawStaticFunctionRegistrar(const std::string& class_name,
+                             const std::string& function_name) {
+    LocalFactory::register_raw_static_function<Func, f, Ret, Arg>(
+        class_name, function_name);
+  }
+};
+
+template <typename Func, Func f, typename Ret, typename Arg>
+struct RegisterRawStaticFunction {
+  static const RawStaticFunctionRegistrar<Func, f, Ret, Arg> registerAs;
+};
 }  // namespace detail
 
 // ####################### Macro utility #######################
@@ -1199,6 +1387,27 @@ struct RegisterStaticFunctionX {
 
 #define VRPC_CALLBACK(...) const std::function<void(__VA_ARGS__)>&
 
+//  ####################### Raw functions #######################
+
+#define VRPC_RAW_MEMBER_FUNCTION(Klass, Ret, Function, Arg)                 \
+  template <>                                                               \
+  const vrpc::detail::RawMemberFunctionRegistrar<                           \
+      Klass, decltype(static_cast<Ret (Klass::*)(Arg)>(&Klass::Function)),  \
+      &Klass::Function, Ret, Arg>                                           \
+      vrpc::detail::RegisterRawMemberFunction<                              \
+          Klass,                                                            \
+          decltype(static_cast<Ret (Klass::*)(Arg)>(&Klass::Function)),     \
+          &Klass::Function, Ret, Arg>::registerAs(#Klass, #Function);
+
+#define VRPC_RAW_STATIC_FUNCTION(Klass, Ret, Function, Arg)                 \
+  template <>                                                               \
+  const vrpc::detail::RawStaticFunctionRegistrar<                           \
+      decltype(static_cast<Ret (*)(Arg)>(Klass::Function)), &Klass::Function, \
+      Ret, Arg>                                                             \
+      vrpc::detail::RegisterRawStaticFunction<                              \
+          decltype(static_cast<Ret (*)(Arg)>(Klass::Function)),             \
+          &Klass::Function, Ret, Arg>::registerAs(#Klass, #Function);
+
 //  ####################### Constructors #######################
 
 #define _VRPC_CTOR_RET_DESC "returns the id of the created instance"
@@ -2,25 +2,80 @@
 #define MQTT_USE_TLS
 #endif
 
-#include <bitset>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <future>
 #include <iomanip>
 #include <iostream>
+#include <list>
 #include <map>
+#include <mutex>
+#include <random>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <unordered_set>
+
+#include <boost/functional/hash.hpp>
 
 #include <vrpc/adapter.hpp>
+#include <vrpc/broker.hpp>
+#include <vrpc/direct.hpp>
 #include <vrpc/json.hpp>
+#include <vrpc/lz4.hpp>
 #include <vrpc/mqtt.hpp>
+#include <vrpc/ring.hpp>
+
+#if defined(__linux__) || defined(__APPLE__)
+#define VRPC_HAS_SHM
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 using namespace std::chrono_literals;
 
 #define VRPC_PROTOCOL_VERSION 3
 
+// Maximum number of topics per SUBSCRIBE/UNSUBSCRIBE packet
+#define VRPC_SUBSCRIBE_BATCH_SIZE 100
+#define VRPC_MAX_WRITE_SIZE (1024 * 1024)
+// Largest request payload taken from lz4 blocks or shared memory
+#define VRPC_MAX_PAYLOAD_SIZE (256 * 1024 * 1024)
+
+// Prefix of lz4 compressed payloads, followed by the uncompressed size
+#define VRPC_LZ4_MAGIC "VLZ4"
+
+// Prefix of payload chunks, followed by transfer id, sequence and total
+#define VRPC_CHUNK_MAGIC "VCHK"
+#define VRPC_CHUNK_HEADER_SIZE (sizeof(VRPC_CHUNK_MAGIC) - 1 + 8 + 4 + 4)
+
+// Coalescers of clients sending nothing for this long are dropped
+#define VRPC_COALESCER_IDLE std::chrono::seconds(60)
+
+// Incoming chunked transfers held at a time, and the bytes they may hold
+#define VRPC_MAX_REASSEMBLIES 64
+#define VRPC_MAX_REASSEMBLY_BYTES VRPC_MAX_PAYLOAD_SIZE
+// Bookkeeping charged per received chunk
+#define VRPC_CHUNK_OVERHEAD 64
+
+// Ring channels served at a time, each has a reader thread
+#define VRPC_MAX_RINGS 64
+
 namespace vrpc {
 
 class VrpcAgent {
   struct BrokerInfo {
     std::string host;
     std::string port;
+    // unix domain socket of a local broker
+    std::string path;
     bool is_ssl;
   };
 
@@ -33,6 +88,143 @@ class VrpcAgent {
   std::string _url;
   std::string _plugin;
   BrokerInfo _broker;
+  std::size_t _parallel_dump_threshold;
+  unsigned _parallel_dump_threads;
+  std::size_t _compression_threshold;
+  std::size_t _shm_threshold;
+  std::atomic<std::size_t> _shm_counter;
+  // names of our segments start with this, those of requests must as well
+  std::string _shm_prefix;
+  // segments handed out, unlinked after a minute if nobody read them
+  std::deque<std::pair<std::chrono::steady_clock::time_point, std::string>>
+      _shm_segments;
+  std::mutex _shm_mutex;
+  std::unique_ptr<boost::asio::steady_timer> _shm_timer;
+  const std::string _hostname;
+  std::size_t _max_packet_size;
+
+  // Outgoing chunked transfers, one chunk is sent per event-loop turn
+  struct Transfer {
+    std::string topic;
+    std::string payload;
+    std::uint64_t id;
+    std::uint32_t next;
+    std::uint32_t total;
+    std::size_t chunk_size;
+    // sent with every chunk (e.g. correlation data)
+    mqtt::v5::properties props;
+  };
+  std::deque<Transfer> _transfers;
+  std::mutex _transfers_mutex;
+  std::uint64_t _transfer_id;
+
+  // Incoming chunked transfers being reassembled
+  struct Reassembly {
+    std::map<std::uint32_t, std::string> chunks;
+    std::uint32_t total;
+    // payload and bookkeeping held
+    std::size_t bytes;
+    std::chrono::steady_clock::time_point updated;
+  };
+  std::unordered_map<std::uint64_t, Reassembly> _reassemblies;
+  std::size_t _reassembly_bytes;
+
+  // Precomputed topics
+  std::string _topic_prefix;
+  std::string _agent_info_topic;
+  std::unordered_map<std::string, std::string> _class_topics;
+
+  // Interned topic levels (classes and functions, instances kept apart as
+  // their names may equal any other level and they come and go)
+  struct ViewHash {
+    std::size_t operator()(mqtt::string_view v) const {
+      return boost::hash_range(v.begin(), v.end());
+    }
+  };
+  typedef std::unordered_map<mqtt::string_view,
+                             std::shared_ptr<const std::string>,
+                             ViewHash>
+      Interned;
+  Interned _interned;
+  Interned _interned_instances;
+
+  // Known routing targets, used with wildcard subscriptions
+  bool _wildcard_subscriptions;
+  struct ClassRoutes {
+    std::unordered_set<std::string> static_functions;
+    std::unordered_set<std::string> member_functions;
+    std::unordered_set<std::string> instances;
+  };
+  std::unordered_map<std::string, ClassRoutes> _routes;
+
+  // Reconnect backoff
+  std::size_t _reconnect_min_ms;
+  std::size_t _reconnect_max_ms;
+  std::size_t _reconnect_attempt;
+  std::mt19937 _random;
+
+  // Session handling
+  bool _persistent_session;
+  bool _subscribed;
+  std::atomic<bool> _stopping;
+
+  // Replies grouped per destination (for clients accepting that)
+  struct Coalescer {
+    std::string frame;
+    std::size_t count;
+    std::chrono::steady_clock::time_point last;
+    // the timer armed last, earlier ones are void
+    std::size_t generation;
+    mqtt::qos qos;
+  };
+  std::chrono::microseconds _coalesce_window;
+  std::size_t _coalesce_max_bytes;
+  std::size_t _coalesce_max_count;
+  std::unordered_map<std::string, Coalescer> _coalescers;
+  std::mutex _coalescers_mutex;
+
+  // Calls without reply
+  std::unordered_set<std::string> _one_way_functions;
+  std::string _error_topic;
+
+  // Quality of service
+  mqtt::qos _subscription_qos;
+  mqtt::qos _reply_qos;
+  mqtt::qos _callback_qos;
+  std::unordered_map<std::string, mqtt::qos> _function_qos;
+
+  // MQTT v5, outgoing topics are aliased by the endpoint, a copy of its LRU
+  // alias mapping tells the bytes saved
+  bool _mqtt5;
+  std::uint16_t _topic_alias_receive_maximum;
+  std::size_t _topic_alias_maximum;
+  std::list<std::string> _alias_lru;
+  std::unordered_map<std::string, std::list<std::string>::iterator>
+      _alias_index;
+
+  // Shared subscription group
+  std::string _pool;
+  // Our name within the pool, the nonce of the current connection (named in
+  // our will) and what the other members announced
+  std::string _pool_member;
+  std::string _pool_nonce;
+  std::string _pool_topic;
+  struct PoolMember {
+    std::string nonce;
+    std::unordered_set<std::string> instances;
+    std::map<std::string, std::set<std::string>> shared;
+  };
+  std::map<std::string, PoolMember> _pool_members;
+  // members (and their connection) we saw leaving without end()
+  std::set<std::pair<std::string, std::string>> _pool_gone;
+
+  // Reply route of MQTT v5 requests
+  struct ResponseRoute {
+    std::string topic;
+    std::string correlation;
+    // client id given as user property "s"
+    std::string client;
+  };
 
   // Isolated instances
   typedef std::unordered_map<std::string,
@@ -40,9 +232,15 @@ class VrpcAgent {
       IsolatedInstances;
   IsolatedInstances _isolated_instances;
 
+  // TLS session reuse and preferences (empty keeps OpenSSL's defaults)
+  bool _tls_session_resumption;
+  std::string _tls_ciphers;
+  std::string _tls_ciphersuites;
+  std::string _tls_curves;
+
 #ifdef VRPC_USE_TLS
 
-  typedef std::shared_ptr<mqtt::callable_overlay<mqtt::sync_client<
+  typedef std::shared_ptr<mqtt::callable_overlay<mqtt::async_client<
       mqtt::tcp_endpoint<mqtt::tls::stream<as::ip::tcp::socket>,
                          as::io_context::strand>>>>
       TlsClient;
@@ -52,7 +250,7 @@ class VrpcAgent {
 #else
 
   // mqtt client
-  typedef std::shared_ptr<mqtt::callable_overlay<mqtt::sync_client<
+  typedef std::shared_ptr<mqtt::callable_overlay<mqtt::async_client<
       mqtt::tcp_endpoint<as::ip::tcp::socket, as::io_context::strand>>>>
       Client;
 
@@ -63,9 +261,35 @@ class VrpcAgent {
   using packet_id_t =
       typename std::remove_reference_t<decltype(*_client)>::packet_id_t;
 
+  // Flow control
+  std::size_t _max_inflight_calls;
+  std::size_t _max_pending_bytes;
+  std::atomic<std::size_t> _inflight_calls;
+  std::atomic<std::size_t> _pending_bytes;
+  std::vector<packet_id_t> _deferred_acks;
+  std::mutex _acks_mutex;
+
   // event loop
   boost::asio::io_context _ioc;
 
+  // In-process broker, the agent's own messages never touch a socket
+  std::uint16_t _embedded_broker_port;
+  std::unique_ptr<Broker> _embedded_broker;
+
+  // Direct (broker-less) calls, clients learn address and token from the
+  // agent information
+  std::uint16_t _direct_port;
+  std::string _direct_address;
+  std::string _direct_token;
+  std::unique_ptr<DirectServer> _direct;
+
+  // Shared-memory rings of clients on the same host, by channel path
+  bool _ring_transport;
+  std::chrono::microseconds _ring_spin;
+#ifdef VRPC_HAS_RING
+  std::unordered_map<std::string, std::shared_ptr<RingConnection>> _rings;
+#endif
+
  public:
   // agent configuration
   struct Options {
@@ -81,8 +305,103 @@ class VrpcAgent {
 #else
     std::string broker = "tcp://vrpc.io:1883";
 #endif
+    // array results of at least this size are serialized in parallel
+    // chunks (0 disables)
+    std::size_t parallel_dump_threshold = 0;
+    unsigned parallel_dump_threads = std::thread::hardware_concurrency();
+    // lz4 compress replies of at least this size for clients supporting it
+    // (0 disables)
+    std::size_t compression_threshold = 0;
+    // hand over replies of at least this size to clients on the same host
+    // through shared memory (0 disables)
+    std::size_t shm_threshold = 0;
+    // split payloads exceeding this size into sequenced chunks (0 disables)
+    std::size_t max_packet_size = 0;
+    // subscribe with a single wildcard and route inside the agent
+    bool wildcard_subscriptions = false;
+    // reconnect delays grow exponentially (with jitter) between these bounds
+    std::size_t reconnect_min_ms = 100;
+    std::size_t reconnect_max_ms = 30000;
+    // keep the broker session (and thus subscriptions) across reconnects
+    bool persistent_session = false;
+    // group replies to the same client arriving within this window into a
+    // single message (0 disables)
+    std::size_t coalesce_window_us = 0;
+    std::size_t coalesce_max_bytes = 64 * 1024;
+    std::size_t coalesce_max_count = 100;
+    // functions ("Class::function") that are never answered
+    std::unordered_set<std::string> one_way_functions;
+    // errors of one-way calls are published here (empty drops them)
+    std::string error_topic;
+    // QoS per message kind, subscriptions and replies can be overridden per
+    // function ("Class::function")
+    mqtt::qos subscription_qos = mqtt::qos::at_least_once;
+    mqtt::qos reply_qos = mqtt::qos::at_least_once;
+    mqtt::qos callback_qos = mqtt::qos::at_least_once;
+    std::unordered_map<std::string, mqtt::qos> function_qos;
+    // use MQTT v5 with automatic topic aliases
+    bool mqtt5 = false;
+    // number of topic aliases the broker may use towards the agent (v5)
+    std::uint16_t topic_alias_maximum = 100;
+    // agents using the same name and pool share the load of static calls
+    // (MQTT shared subscriptions)
+    std::string pool;
+    // name of this agent within its pool, keeps its MQTT session across
+    // restarts (generated if empty, required with persistent_session)
+    std::string pool_member;
+    // calls in progress (or waiting) at most, the broker holds back the rest
+    // (0 is unlimited)
+    std::size_t max_inflight_calls = 0;
+    // stop accepting calls while more bytes wait to be sent (0 is unlimited)
+    std::size_t max_pending_bytes = 0;
+    // host a broker on this loopback port, the agent's own traffic then
+    // stays in memory (0 disables)
+    std::uint16_t embedded_broker_port = 0;
+    // accept calls through a direct TCP connection on this port, e.g. to
+    // save the broker hop (0 disables), by default from this host only
+    std::uint16_t direct_port = 0;
+    std::string direct_address = "127.0.0.1";
+    // accept calls of clients on the same host through shared-memory ring
+    // buffers (Linux only)
+    bool ring_transport = false;
+    // a ring reader spins this long before it sleeps, trading CPU for latency
+    std::size_t ring_spin_us = 50;
+    // resume the previous TLS session when reconnecting, which skips most of
+    // the handshake (TLS builds only)
+    bool tls_session_resumption = true;
+    // OpenSSL cipher lists for TLS 1.2 and for TLS 1.3, and the preferred key
+    // exchange groups (e.g. "X25519:P-256"), empty keeps the defaults
+    std::string tls_ciphers;
+    std::string tls_ciphersuites;
+    std::string tls_curves;
   };
 
+  // traffic counters
+  struct Statistics {
+    // PUBLISH packets and their topic and payload bytes (before aliasing)
+    std::size_t messages_sent = 0;
+    std::size_t bytes_sent = 0;
+    // messages sent with a topic alias instead of the topic (v5)
+    std::size_t topic_aliases_used = 0;
+    // bytes saved by topic aliases, registering an alias costs some
+    std::int64_t bytes_saved = 0;
+    // QoS 0 calls dropped as too many calls were in progress
+    std::size_t calls_dropped = 0;
+    // bytes of messages queued for sending but not yet written (a gauge)
+    std::size_t pending_bytes = 0;
+    // TLS handshakes, those resuming a previous session and the duration of
+    // the latest one
+    std::size_t tls_handshakes = 0;
+    std::size_t tls_sessions_resumed = 0;
+    std::chrono::microseconds last_tls_handshake{0};
+  };
+
+ private:
+  Statistics _statistics;
+  std::mutex _statistics_mutex;
+
+ public:
+
   static std::shared_ptr<VrpcAgent> from_commandline(int argc, char** argv) {
     Options opts;
     std::vector<std::string> args(argv + 1, argv + argc);
@@ -100,6 +419,10 @@ class VrpcAgent {
   }
 
   void serve() {
+    if (_embedded_broker_port > 0) {
+      serve_embedded();
+      return;
+    }
     std::cout << "Domain : " << _domain << std::endl;
     std::cout << "Agent  : " << _agent << std::endl;
     std::cout << "Broker : " << _url << std::endl;
@@ -117,17 +440,7 @@ class VrpcAgent {
       _client->set_password(_token);
     }
     _client->set_client_id(generate_client_id());
-    _client->set_clean_session(true);
-    _client->set_will(mqtt::will(
-        mqtt::allocate_buffer(_domain + "/" + _agent + "/__agentInfo__"),
-        mqtt::allocate_buffer(
-            json{{"status", "offline"}, {"hostname", VrpcAgent::get_hostname()}}
-                .dump()),
-        mqtt::qos::at_least_once | mqtt::retain::yes));
-
-#ifdef VRPC_USE_TLS
-    _client->get_ssl_context().set_verify_mode(boost::asio::ssl::verify_none);
-#endif
+    _client->set_clean_session(!_persistent_session);
 
 #if OPENSSL_VERSION_NUMBER >= 0x10101000L
 
@@ -139,148 +452,147 @@ class VrpcAgent {
     // reconnect handler
     boost::asio::steady_timer timer(_ioc);
     std::function<void()> reconnect;
+    std::function<void()> connect;
     reconnect = [&] {
-      // wait 3 seconds and connect again
-      timer.expires_after(std::chrono::seconds(3));
+      // exponential backoff with jitter avoids reconnect storms
+      timer.expires_after(next_reconnect_delay());
       timer.async_wait([&](boost::system::error_code const& ec) {
         if (!ec) {
           // timer fired
           std::cout << "try connect again" << std::endl;
-          mqtt::error_code ec;
-          _client->connect(ec);  // connect again
-          if (ec) {
-            std::cout << "error " << ec.message() << std::endl;
-            reconnect();
-          }
+          connect();
         }
       });
     };
-
-    // on connection established
-    _client->set_connack_handler(
-        [&](bool sp, mqtt::connect_return_code connack_return_code) {
-          if (connack_return_code == mqtt::connect_return_code::accepted) {
-            std::cout << "[OK]" << std::endl;
-            publish_agent_info();
-            auto topics = generate_topics();
-            for (const auto& topic : topics) {
-              _client->subscribe(topic, mqtt::qos::at_least_once);
-            }
-            // Publish class information
-            const auto& classes = LocalFactory::get_classes();
-            for (const auto& klass : classes) {
-              publish_class_info(klass);
-            }
-          }
-          return true;
-        });
-
-    // on message arrived
-    _client->set_publish_handler([&](mqtt::optional<packet_id_t> packet_id,
-                                     mqtt::publish_options pubopts,
-                                     mqtt::buffer topic_b,
-                                     mqtt::buffer contents) {
-      _VRPC_DEBUG << "message received." << std::endl;
-      _VRPC_DEBUG << "topic: " << topic_b << std::endl;
-      _VRPC_DEBUG << "contents: " << contents << std::endl;
-
-      const std::string topic(topic_b);
-      const auto tokens = VrpcAgent::tokenize(topic, "/");
-
-      // Special case: clientInfo message
-      if (tokens.size() == 4 && tokens[3] == "__clientInfo__") {
-        auto j = json::parse(std::string(contents));
-        if (j["status"].get<std::string>() == "offline") {
-          const std::string client = topic.substr(0, topic.length() - 9);
-          const auto it = _isolated_instances.find(client);
-          if (it != _isolated_instances.end()) {
-            for (const auto& p : it->second) {
-              json j{{"c", p.second},
-                     {"f", "__delete__"},
-                     {"a", json::array({p.first})}};
-              LocalFactory::call(j);
-            }
-            _client->unsubscribe(client + "/__clientInfo__");
-          }
+    connect = [&] {
+      set_will();
+      auto handler = [&](mqtt::error_code ec) {
+        if (ec) {
+          std::cout << "error " << ec.message() << std::endl;
+          reconnect();
         }
-        return true;
+      };
+      if (_mqtt5) {
+        _client->async_connect(connect_properties(), handler);
+      } else {
+        _client->async_connect(handler);
       }
+    };
 
-      if (tokens.size() != 5) {
-        std::cerr << "Received message with invalid topic URI" << std::endl;
+    // on connection established
+    if (_mqtt5) {
+      _client->set_v5_connack_handler([&](bool sp,
+                                          mqtt::v5::connect_reason_code rc,
+                                          mqtt::v5::properties props) {
+        if (rc == mqtt::v5::connect_reason_code::success) {
+          reset_topic_aliases(VrpcAgent::topic_alias_maximum(props));
+          on_connected(sp);
+        }
         return true;
-      }
+      });
+    } else {
+      _client->set_connack_handler(
+          [&](bool sp, mqtt::connect_return_code connack_return_code) {
+            if (connack_return_code == mqtt::connect_return_code::accepted) {
+              on_connected(sp);
+            }
+            return true;
+          });
+    }
 
-      // call execution will be handled by the event-loop
-      boost::asio::post(_ioc, [&, contents, tokens]() {
-        // TODO try witout string
-        auto j = json::parse(std::string(contents));
-        const std::string klass = tokens[2];
-        const std::string instance = tokens[3];
-        const std::string function = tokens[4];
-        const std::string sender = j.at("s");
-        // set context for correct call
-        j["c"] = instance == "__static__" ? klass : instance;
-        // set function
-        j["f"] = function;
-
-        // The actual call to the existing code
-        // NOTE: the json object is mutated during the call
-        LocalFactory::call(j);
-
-        // Lifetime handling
-        if (function == "__createIsolated__") {
-          // Return value = instance
-          const std::string instance(j["r"].get<std::string>());
-          subscribe_to_instance(klass, instance);
-          register_isolated_instance(instance, klass, sender);
-        } else if (function == "__createShared__") {
-          const std::string instance(j["r"].get<std::string>());
-          subscribe_to_instance(klass, instance);
-          // Publish classInfo message (as number of instances changed)
-          publish_class_info(klass);
-        } else if (function == "__delete__") {
-          unsubscribe_from_instance(klass, instance);
-          publish_class_info(klass);
-          unregister_isolated_instance(instance, klass, sender);
-        }
-        // RPC answer goes here
-        _client->publish(sender, j.dump(), mqtt::qos::at_least_once);
+    // on message arrived
+    if (_mqtt5) {
+      _client->set_v5_publish_handler([&](mqtt::optional<packet_id_t> packet_id,
+                                          mqtt::publish_options pubopts,
+                                          mqtt::buffer topic_b,
+                                          mqtt::buffer contents,
+                                          mqtt::v5::properties props) {
+        return on_message(packet_id, std::move(topic_b), std::move(contents),
+                          props);
       });
-      return true;
-    });
+    } else {
+      _client->set_publish_handler([&](mqtt::optional<packet_id_t> packet_id,
+                                       mqtt::publish_options pubopts,
+                                       mqtt::buffer topic_b,
+                                       mqtt::buffer contents) {
+        return on_message(packet_id, std::move(topic_b), std::move(contents));
+      });
+    }
 
     // on connection closed
     _client->set_close_handler([&] {
       std::cout << "connection closed" << std::endl;
-      reconnect();
+      if (_stopping) {
+        _ioc.stop();
+      } else {
+        reconnect();
+      }
     });
 
     // on error
     _client->set_error_handler([&](boost::system::error_code const& ec) {
       std::cout << "connection error " << ec.message() << std::endl;
-      reconnect();
+      if (_stopping) {
+        _ioc.stop();
+      } else {
+        reconnect();
+      }
     });
 
+    start_direct();
     // Connect
-    mqtt::error_code ec;
-    _client->connect(ec);
-    if (ec) {
-      std::cout << "error " << ec.message() << std::endl;
-      reconnect();
-    }
+    connect();
     _ioc.run();
   }
 
+  Statistics statistics() {
+    std::lock_guard<std::mutex> lock(_statistics_mutex);
+    Statistics statistics(_statistics);
+    statistics.pending_bytes = _pending_bytes;
+    return statistics;
+  }
+
   void end() {
-    _client->publish(_domain + "/" + _agent + "/__agentInfo__",
-                     json{{"status", "offline"},
-                          {"hostname", VrpcAgent::get_hostname()},
-                          {"v", VRPC_PROTOCOL_VERSION}}
-                         .dump(),
-                     mqtt::qos::at_least_once | mqtt::retain::yes);
-    _client->disconnect(3s);
-    _ioc.stop();
+    _stopping = true;
+    // the event-loop stops once the queued messages are out
+    boost::asio::post(_ioc, [this]() {
+      if (_direct) _direct->close();
+      detach_rings();
+      sweep_shared_memory(true);
+      std::string offline = json{{"status", "offline"},
+                                 {"hostname", VrpcAgent::get_hostname()},
+                                 {"v", VRPC_PROTOCOL_VERSION}}
+                                .dump();
+      if (_embedded_broker) {
+        // clients are told before the broker goes down
+        _embedded_broker->publish(
+            _agent_info_topic, std::move(offline),
+            mqtt::qos::at_least_once | mqtt::retain::yes, {}, [this]() {
+              _embedded_broker->close();
+              _ioc.stop();
+            });
+        return;
+      }
+      if (!_client->connected()) {
+        _ioc.stop();
+        return;
+      }
+      if (!_pool.empty()) {
+        publish(_pool_topic + _pool_member, std::string(),
+                mqtt::qos::at_least_once | mqtt::retain::yes);
+        // the other members keep the agent online, our instances are gone
+        if (!_pool_members.empty()) {
+          for (const auto& klass : LocalFactory::get_classes()) {
+            publish_class_info(klass);
+          }
+          _client->async_disconnect(3s);
+          return;
+        }
+      }
+      publish(_agent_info_topic, std::move(offline),
+              mqtt::qos::at_least_once | mqtt::retain::yes);
+      _client->async_disconnect(3s);
+    });
   }
 
  private:
@@ -292,25 +604,144 @@ class VrpcAgent {
         _token(options.token),
         _version(options.version),
         _url(options.broker),
-        _broker(VrpcAgent::extract_broker_info(options.broker)) {
+        _broker(VrpcAgent::extract_broker_info(options.broker)),
+        _parallel_dump_threshold(options.parallel_dump_threshold),
+        _parallel_dump_threads(std::max(1u, options.parallel_dump_threads)),
+        _compression_threshold(options.compression_threshold),
+        _shm_threshold(options.shm_threshold),
+        _shm_counter(0),
+        _hostname(VrpcAgent::get_hostname()),
+        _max_packet_size(options.max_packet_size),
+        _transfer_id(std::random_device{}()),
+        _reassembly_bytes(0),
+        _wildcard_subscriptions(options.wildcard_subscriptions),
+        _reconnect_min_ms(std::max<std::size_t>(1, options.reconnect_min_ms)),
+        _reconnect_max_ms(options.reconnect_max_ms),
+        _reconnect_attempt(0),
+        _random(std::random_device{}()),
+        _persistent_session(options.persistent_session),
+        _subscribed(false),
+        _stopping(false),
+        _coalesce_window(options.coalesce_window_us),
+        _coalesce_max_bytes(options.max_packet_size > 0
+                                ? std::min(options.coalesce_max_bytes,
+                                           options.max_packet_size)
+                                : options.coalesce_max_bytes),
+        _coalesce_max_count(std::max<std::size_t>(1, options.coalesce_max_count)),
+        _one_way_functions(options.one_way_functions),
+        _error_topic(options.error_topic),
+        _subscription_qos(options.subscription_qos),
+        _reply_qos(options.reply_qos),
+        _callback_qos(options.callback_qos),
+        _function_qos(options.function_qos),
+        _mqtt5(options.mqtt5),
+        _topic_alias_receive_maximum(options.topic_alias_maximum),
+        _topic_alias_maximum(0),
+        _pool(options.pool),
+        _pool_member(options.pool_member),
+        _tls_session_resumption(options.tls_session_resumption),
+        _tls_ciphers(options.tls_ciphers),
+        _tls_ciphersuites(options.tls_ciphersuites),
+        _tls_curves(options.tls_curves),
+        _max_inflight_calls(options.max_inflight_calls),
+        _max_pending_bytes(options.max_pending_bytes),
+        _inflight_calls(0),
+        _pending_bytes(0),
+        _embedded_broker_port(options.embedded_broker_port),
+        _direct_port(options.direct_port),
+        _direct_address(options.direct_address),
+        _ring_transport(options.ring_transport),
+        // spinning only pays off if the client runs meanwhile
+        _ring_spin(std::thread::hardware_concurrency() > 1 ? options.ring_spin_us
+                                                           : 0) {
+    if (_max_packet_size > 0 && _max_packet_size <= VRPC_CHUNK_HEADER_SIZE) {
+      throw std::runtime_error("Maximum packet size is too small for chunking");
+    }
+    // without a broker session there is nobody holding back calls
+    if (_embedded_broker_port > 0) {
+      _max_inflight_calls = 0;
+    }
+    // only PUBACKs are sent manually
+    if (_max_inflight_calls > 0) {
+      bool exactly_once = _subscription_qos == mqtt::qos::exactly_once;
+      for (const auto& kv : _function_qos) {
+        exactly_once |= kv.second == mqtt::qos::exactly_once;
+      }
+      if (exactly_once) {
+        throw std::runtime_error("Flow control supports QoS 0 and 1 only");
+      }
+    }
+    // a wildcard would make every agent of the pool receive all static calls,
+    // a ring channel must be attached by a single agent
+    if (!_pool.empty()) {
+      _wildcard_subscriptions = false;
+      _ring_transport = false;
+      if (_pool_member.empty()) {
+        // a generated name can't pick up its session after a restart
+        if (_persistent_session) {
+          throw std::runtime_error(
+              "Pool members with a persistent session need a pool_member");
+        }
+        _pool_member = _hostname + "-" + std::to_string(std::random_device{}());
+      }
+    }
+#ifndef VRPC_HAS_RING
+    if (_ring_transport) {
+      throw std::runtime_error("Ring transport is not supported");
+    }
+#endif
     // TODO validate domain and agent
     if (_agent.empty()) {
       _agent = VrpcAgent::generate_agent_name();
     }
+    _topic_prefix = _domain + "/" + _agent + "/";
+    _agent_info_topic = _topic_prefix + "__agentInfo__";
+    _pool_topic = _topic_prefix + "__pool__/";
+    _shm_prefix = "/vrpc-" +
+                  std::to_string(std::hash<std::string>{}(_topic_prefix)) +
+                  "-";
 // instantiate mqtt client
 #ifdef VRPC_USE_TLS
 
-    _client = mqtt::make_tls_sync_client(_ioc, _broker.host, _broker.port);
+    _client = mqtt::make_tls_async_client(
+        _ioc, _broker.host, _broker.port,
+        _mqtt5 ? mqtt::protocol_version::v5 : mqtt::protocol_version::v3_1_1);
 
 #else
 
-    _client = mqtt::make_sync_client(_ioc, _broker.host, _broker.port);
+    _client = mqtt::make_async_client(
+        _ioc, _broker.host, _broker.port,
+        _mqtt5 ? mqtt::protocol_version::v5 : mqtt::protocol_version::v3_1_1);
 
 #endif
+    // a local broker is reached without the TCP stack
+    if (!_broker.path.empty()) {
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+      _client->set_unix_socket_path(_broker.path);
+#else
+      throw std::runtime_error("Unix domain sockets are not supported");
+#endif
+    }
+#ifdef VRPC_USE_TLS
+    configure_tls();
+#endif
+    // pending messages are flushed together in a single (vectored) write
+    _client->set_max_queue_send_count(0);
+    _client->set_max_queue_send_size(VRPC_MAX_WRITE_SIZE);
+    // calls are acknowledged once done (flow control)
+    if (_max_inflight_calls > 0) {
+      _client->set_auto_pub_response(false);
+    }
+    if (_mqtt5) {
+      _client->set_auto_map_topic_alias_send();
+      _client->set_topic_alias_maximum(_topic_alias_receive_maximum);
+    }
     // register handler for vrpc callbacks
     vrpc::Callback::register_callback_handler([&](const json& j) {
-      const std::string sender = j["s"].get<std::string>();
-      _client->publish(sender, j.dump(), mqtt::qos::at_least_once);
+      const auto it = j.find("s");
+      if (it == j.end() || !it->is_string()) return;  // nobody to call back
+      const std::string sender = it->get<std::string>();
+      reply(sender, encode(j), _callback_qos);
     });
   }
 
@@ -358,6 +789,17 @@ class VrpcAgent {
           "Missing scheme in broker url (use e.g. mqtts://<hostname>)");
     }
     BrokerInfo info;
+    // unix:///path/to/socket
+    if (broker.substr(0, pos1) == "unix") {
+      info.path = broker.substr(pos1 + 3);
+      if (info.path.empty()) {
+        throw std::runtime_error(
+            "Missing socket path in broker url (use e.g. unix:///<path>)");
+      }
+      info.host = "localhost";
+      info.is_ssl = false;
+      return info;
+    }
     info.is_ssl =
         broker.substr(0, pos1) == "ssl" || broker.substr(0, pos1) == "mqtts";
     info.host = broker.substr(pos1 + 3);
@@ -429,8 +871,26 @@ class VrpcAgent {
 #endif
   }
 
+  // The will marks the agent offline, in a pool it names the member (and
+  // connection) so the others can take it back
+  void set_will() {
+    json j{{"status", "offline"}, {"hostname", VrpcAgent::get_hostname()}};
+    if (!_pool.empty()) {
+      _pool_nonce = std::to_string(std::random_device{}());
+      j["member"] = _pool_member;
+      j["nonce"] = _pool_nonce;
+    }
+    _client->set_will(mqtt::will(mqtt::allocate_buffer(_agent_info_topic),
+                                 mqtt::allocate_buffer(j.dump()),
+                                 mqtt::qos::at_least_once | mqtt::retain::yes));
+  }
+
   std::string generate_client_id() {
-    const std::string h = _domain + _agent;
+    std::string h = _domain + _agent;
+    // agents of a pool share their name, but not their session
+    if (!_pool.empty()) {
+      h += "/" + _pool + "/" + _pool_member;
+    }
     return "va3" + std::to_string(std::hash<std::string>{}(h)).substr(0, 20);
   }
 
@@ -440,12 +900,67 @@ class VrpcAgent {
     j["hostname"] = VrpcAgent::get_hostname();
     j["version"] = _version;
     j["v"] = VRPC_PROTOCOL_VERSION;
-    const std::string t(_domain + "/" + _agent + "/__agentInfo__");
-    _client->publish(t, j.dump(), mqtt::qos::at_least_once | mqtt::retain::yes);
+    if (_compression_threshold > 0) {
+      j["compression"] = "lz4";
+    }
+    if (_shm_threshold > 0) {
+      j["sharedMemory"] = true;
+    }
+    if (_shm_threshold > 0 || _ring_transport) {
+      j["sharedMemoryPrefix"] = _shm_prefix;
+    }
+    if (_max_packet_size > 0) {
+      j["maxPacketSize"] = _max_packet_size;
+    }
+    if (_coalesce_window.count() > 0) {
+      j["coalescing"] = true;
+    }
+    if (!_pool.empty()) {
+      j["pool"] = _pool;
+    }
+    if (_ring_transport) {
+      j["ring"] = true;
+    }
+    if (_direct) {
+      // an unspecified address is reached through the hostname
+      const bool any = boost::asio::ip::make_address(_direct_address)
+                           .is_unspecified();
+      j["direct"] = {{"host", any ? _hostname : _direct_address},
+                     {"port", _direct->port()},
+                     {"token", _direct_token}};
+    }
+    publish(_agent_info_topic, j.dump(),
+            mqtt::qos::at_least_once | mqtt::retain::yes);
   }
 
   std::vector<std::string> generate_topics() const {
     std::vector<std::string> topics;
+    topics.push_back(shared(_topic_prefix + "__batch__"));
+    if (!_pool.empty()) {
+      topics.push_back(_pool_topic + "+");
+      topics.push_back(_agent_info_topic);
+    }
+    if (_ring_transport) {
+      topics.push_back(_topic_prefix + "__ring__");
+    }
+    // Clients owning isolated instances (survived a reconnect)
+    for (const auto& kv : _isolated_instances) {
+      topics.push_back(kv.first + "/__clientInfo__");
+    }
+    if (_wildcard_subscriptions) {
+      // a single subscription, routing happens in the agent
+      topics.push_back(_topic_prefix + "+/+/+");
+      return topics;
+    }
+    // Instances (survived a reconnect)
+    for (const auto& kv : _routes) {
+      for (const auto& instance : kv.second.instances) {
+        for (const auto& func : kv.second.member_functions) {
+          topics.push_back(_topic_prefix + kv.first + "/" + instance + "/" +
+                           func);
+        }
+      }
+    }
     // Register all static functions
     const auto& classes = LocalFactory::get_classes();
     for (const auto& klass : classes) {
@@ -457,81 +972,1718 @@ class VrpcAgent {
           continue;
         }
         no_dups.insert(func_base);
-        const std::string topic(_domain + "/" + _agent + "/" + klass +
-                                "/__static__/" + func_base);
-        topics.push_back(topic);
+        // lifetime calls reach every member of a pool, the owner answers
+        const std::string topic(_topic_prefix + klass + "/__static__/" +
+                                func_base);
+        topics.push_back(VrpcAgent::is_lifetime_function(func_base)
+                             ? topic
+                             : shared(topic));
         _VRPC_DEBUG << "Preparing to have topic: " << topic << std::endl;
       }
     }
     return topics;
   }
 
-  static std::string remove_signature(const std::string& function) {
-    const size_t pos = function.find_first_of("-");
-    return pos == std::string::npos ? function : function.substr(0, pos);
+  // Static calls are balanced between the agents of a pool
+  std::string shared(const std::string& topic) const {
+    if (_pool.empty()) return topic;
+    return "$share/" + _pool + "/" + topic;
   }
 
-  void publish_class_info(const std::string& klass) {
-    json j;
-    j["className"] = klass;
-    j["instances"] = LocalFactory::get_instances(klass);
-    j["memberFunctions"] = LocalFactory::get_member_functions(klass);
-    j["staticFunctions"] = LocalFactory::get_static_functions(klass);
-    j["meta"] = LocalFactory::get_meta_data(klass);
-    j["v"] = VRPC_PROTOCOL_VERSION;
-    std::string t(_domain + "/" + _agent + "/" + klass + "/__classInfo__");
-    _client->publish(t, j.dump(), mqtt::qos::at_least_once | mqtt::retain::yes);
-  }
-
-  static std::vector<std::string> tokenize(const std::string& input,
-                                           char const* delimiters) {
-    std::vector<std::string> output;
-    std::bitset<255> delims;
-    while (*delimiters) {
-      unsigned char code = *delimiters++;
-      delims[code] = true;
-    }
-    std::string::const_iterator beg;
-    bool in_token = false;
-    for (std::string::const_iterator it = input.begin(), end = input.end();
-         it != end; ++it) {
-      if (delims[*it & 0xff]) {
-        if (in_token) {
-          output.push_back(std::string(beg, it));
-          in_token = false;
+  static bool is_lifetime_function(const std::string& function) {
+    return function == "__createIsolated__" ||
+           function == "__createShared__" || function == "__delete__";
+  }
+
+  // Of the lifetime calls every member of a pool receives, the member
+  // holding the instance executes them, or if nobody does, the member the
+  // instance name hashes to (rendezvous hashing)
+  bool owns_lifetime_call(const std::string& klass,
+                          const std::string& function,
+                          const json& j) const {
+    if (_pool.empty() || !VrpcAgent::is_lifetime_function(function)) {
+      return true;
+    }
+    std::string instance;
+    const auto a = j.find("a");
+    if (a != j.end() && a->is_array() && !a->empty() && (*a)[0].is_string()) {
+      instance = (*a)[0].get<std::string>();
+    }
+    const auto routes = _routes.find(klass);
+    if (routes != _routes.end() && routes->second.instances.count(instance)) {
+      return true;
+    }
+    auto best = std::make_pair(VrpcAgent::fnv1a(_pool_member + "/" + instance),
+                               _pool_member);
+    for (const auto& kv : _pool_members) {
+      if (kv.second.instances.count(instance)) return false;
+      best = std::max(
+          best, std::make_pair(VrpcAgent::fnv1a(kv.first + "/" + instance),
+                               kv.first));
+    }
+    return best.second == _pool_member;
+  }
+
+  // Stable across builds and platforms, unlike std::hash (FNV-1a, with a
+  // final mix so that similar member names spread well)
+  static std::uint64_t fnv1a(const std::string& value) {
+    std::uint64_t hash = 14695981039346656037ull;
+    for (const unsigned char c : value) {
+      hash ^= c;
+      hash *= 1099511628211ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    return hash ^ (hash >> 33);
+  }
+
+  // Announces our instances to the other members of the pool (retained)
+  void publish_pool_member() {
+    if (_pool.empty()) return;
+    json instances = json::array();
+    json shared = json::object();
+    for (const auto& kv : _routes) {
+      for (const auto& instance : kv.second.instances) {
+        instances.push_back(instance);
+      }
+      shared[kv.first] = LocalFactory::get_instances(kv.first);
+    }
+    publish(_pool_topic + _pool_member,
+            json{{"status", "online"},
+                 {"nonce", _pool_nonce},
+                 {"instances", instances},
+                 {"shared", shared}}
+                .dump(),
+            mqtt::qos::at_least_once | mqtt::retain::yes);
+  }
+
+  void handle_pool_member(const std::string& member,
+                          const mqtt::buffer& contents) {
+    const auto j =
+        json::parse(contents.begin(), contents.end(), nullptr, false);
+    const bool online =
+        j.is_object() && j.value("status", json()) == "online";
+    if (member == _pool_member) {
+      // somebody took our announcement for the one of a gone connection
+      if (!online && !_stopping) publish_pool_member();
+      return;
+    }
+    if (online) {
+      PoolMember m;
+      try {
+        m.nonce = j.value("nonce", std::string());
+        if (_pool_gone.count({member, m.nonce})) return;
+        const json instances(j.value("instances", json::array()));
+        for (const auto& instance : instances) {
+          m.instances.insert(instance.get<std::string>());
+        }
+        const json shared(j.value("shared", json::object()));
+        for (auto it = shared.begin(); it != shared.end(); ++it) {
+          m.shared[it.key()] = it.value().get<std::set<std::string>>();
         }
-      } else if (!in_token) {
-        beg = it;
-        in_token = true;
+      } catch (const std::exception& e) {
+        std::cerr << "Dropped malformed pool member: " << e.what()
+                  << std::endl;
+        return;
       }
+      _pool_members[member] = std::move(m);
+    } else if (_pool_members.erase(member) == 0) {
+      return;
     }
-    if (in_token) {
-      output.push_back(std::string(beg, input.end()));
+    for (const auto& klass : LocalFactory::get_classes()) {
+      publish_class_info(klass);
     }
-    return output;
   }
 
-  void subscribe_to_instance(const std::string& klass,
-                             const std::string& instance) {
-    for (auto function : LocalFactory::get_member_functions(klass)) {
-      function = VrpcAgent::remove_signature(function);
-      const std::string topic(_domain + "/" + _agent + "/" + klass + "/" +
-                              instance + "/" + function);
-      _client->subscribe(topic, mqtt::qos::at_least_once);
-      _VRPC_DEBUG << "Subscribed to new topic: " << topic << std::endl;
+  // The will of a member leaving without end() marks the whole agent
+  // offline, the remaining members take it back and forget the member
+  void handle_pool_agent_info(const mqtt::buffer& contents) {
+    const auto j =
+        json::parse(contents.begin(), contents.end(), nullptr, false);
+    if (_stopping || !j.is_object() ||
+        j.value("status", json()) != "offline") {
+      return;
+    }
+    const auto member = j.find("member");
+    const auto nonce = j.find("nonce");
+    if (member != j.end() && member->is_string() && nonce != j.end() &&
+        nonce->is_string() && *member != _pool_member) {
+      const std::string name(member->get<std::string>());
+      _pool_gone.emplace(name, nonce->get<std::string>());
+      const auto it = _pool_members.find(name);
+      // unless it came back meanwhile
+      if (it == _pool_members.end() || it->second.nonce == *nonce) {
+        if (it != _pool_members.end()) _pool_members.erase(it);
+        publish(_pool_topic + name, std::string(),
+                mqtt::qos::at_least_once | mqtt::retain::yes);
+        for (const auto& klass : LocalFactory::get_classes()) {
+          publish_class_info(klass);
+        }
+      }
     }
+    publish_agent_info();
   }
 
-  void unsubscribe_from_instance(const std::string& klass,
-                                 const std::string& instance) {
-    for (auto function : LocalFactory::get_member_functions(klass)) {
-      function = VrpcAgent::remove_signature(function);
-      const std::string topic(_domain + "/" + _agent + "/" + klass + "/" +
-                              instance + "/" + function);
-      _client->unsubscribe(topic);
-      _VRPC_DEBUG << "Unsubscribed from topic after deletion: " << topic
-                  << std::endl;
+  bool handle_raw_call(const mqtt::buffer& topic,
+                       const std::string& context,
+                       const std::string& function,
+                       const mqtt::buffer& contents,
+                       mqtt::qos qos) {
+    std::string result;
+    try {
+      if (!LocalFactory::call_raw(context, function, contents.data(),
+                                  contents.size(), result)) {
+        return false;
+      }
+    } catch (const std::exception& e) {
+      std::cerr << "Raw function " << function << " failed: " << e.what()
+                << std::endl;
+      return true;
+    }
+    // Raw results are published next to the request topic
+    if (!result.empty()) {
+      send(std::string(topic) + "/__raw__", std::move(result), qos);
+    }
+    return true;
+  }
+
+#ifdef VRPC_USE_TLS
+
+  void configure_tls() {
+    auto& ctx = _client->get_ssl_context();
+    ctx.set_verify_mode(boost::asio::ssl::verify_none);
+    SSL_CTX* native = ctx.native_handle();
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    // TLS 1.3 saves a round trip on full handshakes, 1.2 stays the minimum
+    SSL_CTX_set_max_proto_version(native, 0);
+    if (!_tls_ciphersuites.empty() &&
+        SSL_CTX_set_ciphersuites(native, _tls_ciphersuites.c_str()) != 1) {
+      throw std::runtime_error("Invalid TLS 1.3 cipher suites: " +
+                               _tls_ciphersuites);
+    }
+#endif
+    if (!_tls_ciphers.empty() &&
+        SSL_CTX_set_cipher_list(native, _tls_ciphers.c_str()) != 1) {
+      throw std::runtime_error("Invalid TLS cipher list: " + _tls_ciphers);
+    }
+    if (!_tls_curves.empty() &&
+        SSL_CTX_set1_curves_list(native, _tls_curves.c_str()) != 1) {
+      throw std::runtime_error("Invalid TLS curves: " + _tls_curves);
+    }
+    _client->set_tls_session_resumption(_tls_session_resumption);
+    _client->set_tls_handshake_handler(
+        [this](std::chrono::steady_clock::duration duration, bool resumed) {
+          const auto us =
+              std::chrono::duration_cast<std::chrono::microseconds>(duration);
+          _VRPC_DEBUG << "TLS handshake took " << us.count() << "us"
+                      << (resumed ? " (resumed)" : "") << std::endl;
+          std::lock_guard<std::mutex> lock(_statistics_mutex);
+          ++_statistics.tls_handshakes;
+          if (resumed) ++_statistics.tls_sessions_resumed;
+          _statistics.last_tls_handshake = us;
+        });
+  }
+
+#endif
+
+  void start_direct() {
+    if (_direct_port == 0) return;
+    // only clients allowed to read the agent information may connect
+    std::random_device random;
+    std::ostringstream token;
+    for (int i = 0; i < 4; ++i) {
+      token << std::hex << std::setw(8) << std::setfill('0') << random();
     }
+    _direct_token = token.str();
+    _direct.reset(new DirectServer(
+        _ioc, _direct_address, _direct_port, _direct_token,
+        [this](const std::shared_ptr<DirectConnection>& connection,
+               std::string frame) {
+          // call execution will be handled by the event-loop
+          boost::asio::post(_ioc, [this, connection, frame]() {
+            handle_direct_call(connection, frame);
+          });
+        }));
+  }
+
+  // Calls arriving through a direct connection are answered through it,
+  // callbacks and lifetime handling still use MQTT
+  void handle_direct_call(const std::shared_ptr<DirectConnection>& connection,
+                          const std::string& frame) {
+    json j;
+    if (handle_frame_call(frame, j)) connection->send(encode(j));
+  }
+
+  // Executes a call envelope that arrived outside of MQTT (direct or ring
+  // transport), false if there is nothing to answer
+  bool handle_frame_call(const std::string& frame, json& j) {
+    try {
+      j = decode(mqtt::buffer(mqtt::string_view(frame)));
+    } catch (const std::exception& e) {
+      std::cerr << "Dropped malformed message: " << e.what() << std::endl;
+      return false;
+    }
+    if (!j.is_object()) return false;
+    const auto s = j.find("s");
+    const std::string sender =
+        s != j.end() && s->is_string() ? s->get<std::string>() : "";
+    bool one_way = false;
+    try {
+      const std::string context(j.at("c").get<std::string>());
+      const std::string function(j.at("f").get<std::string>());
+      const std::string& klass = class_of(context);
+      one_way = is_one_way(klass, function, j);
+      if (j.find("a") == j.end()) j["a"] = json::array();
+      if (!VrpcAgent::refuse_isolated(function, sender, j)) {
+        execute(klass, function, sender, j);
+      }
+    } catch (const std::exception& e) {
+      j["e"] = std::string("Invalid call: ") + e.what();
+    }
+    if (one_way) {
+      report_error(j);
+      return false;
+    }
+    return true;
+  }
+
+#ifdef VRPC_HAS_RING
+
+  // Creates a ring channel for the client asking with {"s": <topic>,
+  // "i": <id>, "p": <pid>, "k": <capacity>} and answers its path ("r"), a
+  // reader thread hands the calls over to the event-loop
+  void attach_ring(const mqtt::buffer& contents) {
+    json j;
+    std::string sender;
+    std::int32_t pid;
+    std::size_t capacity;
+    try {
+      j = json::parse(contents.begin(), contents.end());
+      sender = j.at("s").get<std::string>();
+      pid = j.at("p").get<std::int32_t>();
+      capacity = j.value("k", std::size_t(0));
+    } catch (const std::exception& e) {
+      std::cerr << "Dropped malformed ring request: " << e.what() << std::endl;
+      return;
+    }
+    std::shared_ptr<RingConnection> connection;
+    try {
+      // the liveness check of the client would not name a single process
+      if (pid <= 0) throw std::runtime_error("invalid process id");
+      if (_rings.size() >= VRPC_MAX_RINGS) {
+        throw std::runtime_error("too many ring channels");
+      }
+      auto channel = RingChannel::create(capacity, pid);
+      const std::string name(channel->name());
+      connection = std::make_shared<RingConnection>(
+          _ioc, std::move(channel), _ring_spin,
+          [this, name](std::vector<std::string> frames) {
+            boost::asio::post(_ioc, [this, name, frames = std::move(frames)]() {
+              handle_ring_calls(name, frames);
+            });
+          },
+          [this, name]() {
+            boost::asio::post(_ioc, [this, name]() { detach_ring(name); });
+          });
+      _rings[name] = connection;
+      j["r"] = name;
+    } catch (const std::exception& e) {
+      j["e"] = std::string("Failed creating ring channel: ") + e.what();
+      reply(sender, encode(j), _reply_qos);
+      return;
+    }
+    connection->start();
+    _VRPC_DEBUG << "Attached ring: " << j["r"] << std::endl;
+    reply(sender, encode(j), _reply_qos);
+  }
+
+  void handle_ring_calls(const std::string& name,
+                         const std::vector<std::string>& frames) {
+    const auto it = _rings.find(name);
+    if (it == _rings.end()) return;
+    const auto connection = it->second;
+    for (const auto& frame : frames) {
+      json j;
+      if (!handle_frame_call(frame, j)) continue;
+      std::string payload(encode(j));
+      // too large for the ring, handed over like any large reply
+      json handle;
+      if (payload.size() > connection->max_message_size() &&
+          write_shared_memory(payload, handle)) {
+        json k{{"m", handle}};
+        if (j.find("i") != j.end()) k["i"] = j["i"];
+        payload = k.dump();
+      }
+      connection->send(std::move(payload));
+    }
+  }
+
+  void detach_ring(const std::string& name) {
+    const auto it = _rings.find(name);
+    if (it == _rings.end()) return;
+    it->second->close();
+    _rings.erase(it);
+    _VRPC_DEBUG << "Detached ring: " << name << std::endl;
+  }
+
+  void detach_rings() {
+    for (const auto& kv : _rings) kv.second->close();
+    _rings.clear();
+  }
+
+#else
+
+  void attach_ring(const mqtt::buffer&) {}
+
+  void detach_rings() {}
+
+#endif
+
+  // Class of a call context, which is a class or an instance name
+  const std::string& class_of(const std::string& context) const {
+    if (_routes.find(context) != _routes.end()) return context;
+    for (const auto& kv : _routes) {
+      if (kv.second.instances.count(context) > 0) return kv.first;
+    }
+    return context;
+  }
+
+  void serve_embedded() {
+    std::cout << "Domain : " << _domain << std::endl;
+    std::cout << "Agent  : " << _agent << std::endl;
+    std::cout << "Broker : embedded, port " << _embedded_broker_port
+              << std::endl;
+    std::cout << "Starting message broker... " << std::flush;
+    _embedded_broker.reset(new Broker(_ioc, _embedded_broker_port));
+    _embedded_broker->set_local_handler([this](mqtt::buffer topic,
+                                               mqtt::buffer contents,
+                                               mqtt::v5::properties props) {
+      on_message(mqtt::nullopt, std::move(topic), std::move(contents), props);
+    });
+    start_direct();
+    on_connected(false);
+    _ioc.run();
+  }
+
+  void on_connected(bool sp) {
+    std::cout << "[OK]" << std::endl;
+    {
+      // acknowledgements belong to the previous connection
+      std::lock_guard<std::mutex> lock(_acks_mutex);
+      _deferred_acks.clear();
+    }
+    _reconnect_attempt = 0;
+    intern_classes();
+    // a persistent session still holds all our subscriptions
+    if (!(sp && _persistent_session && _subscribed)) {
+      subscribe(generate_topics());
+      _subscribed = true;
+    }
+    // after subscribing, members of a pool still get the will of a member
+    // gone before, rather than our own announcement
+    publish_agent_info();
+    publish_pool_member();
+    // Publish class information
+    const auto& classes = LocalFactory::get_classes();
+    for (const auto& klass : classes) {
+      publish_class_info(klass);
+    }
+  }
+
+  bool on_message(mqtt::optional<packet_id_t> packet_id,
+                  mqtt::buffer topic_b,
+                  mqtt::buffer contents,
+                  const mqtt::v5::properties& props = {}) {
+    _VRPC_DEBUG << "message received." << std::endl;
+    _VRPC_DEBUG << "topic: " << topic_b << std::endl;
+    _VRPC_DEBUG << "contents: " << contents << std::endl;
+
+    // QoS 0 messages can't be held back by the broker
+    if (!packet_id && _max_inflight_calls > 0 &&
+        _inflight_calls >= _max_inflight_calls) {
+      std::lock_guard<std::mutex> lock(_statistics_mutex);
+      ++_statistics.calls_dropped;
+      return true;
+    }
+    // acknowledged once all work on the message is done
+    const auto ack = acknowledgement(packet_id);
+
+    std::array<mqtt::string_view, 5> tokens;
+    const std::size_t count = VrpcAgent::tokenize(topic_b, tokens);
+
+    // Members of our pool announce their instances and may leave their will
+    if (!_pool.empty() && count == 4 && tokens[2] == "__pool__") {
+      handle_pool_member(std::string(tokens[3]), contents);
+      return true;
+    }
+    if (!_pool.empty() && count == 3 && tokens[2] == "__agentInfo__") {
+      handle_pool_agent_info(contents);
+      return true;
+    }
+
+    // Special case: clientInfo message
+    if (count == 4 && tokens[3] == "__clientInfo__") {
+      const auto j = json::parse(contents.begin(), contents.end(), nullptr,
+                                 false);
+      if (j.is_object() && j.value("status", json()) == "offline") {
+        const std::string client(
+            topic_b.substr(0, topic_b.size() - sizeof("/__clientInfo__") + 1));
+        const auto it = _isolated_instances.find(client);
+        if (it != _isolated_instances.end()) {
+          for (const auto& p : it->second) {
+            json j{{"c", p.second},
+                   {"f", "__delete__"},
+                   {"a", json::array({p.first})}};
+            LocalFactory::call(j);
+            unsubscribe_from_instance(p.second, p.first);
+          }
+          // not to be resubscribed (and deleted again) after a reconnect
+          _isolated_instances.erase(it);
+          unsubscribe({client + "/__clientInfo__"});
+          publish_pool_member();
+        }
+        std::lock_guard<std::mutex> lock(_coalescers_mutex);
+        _coalescers.erase(client);
+      }
+      return true;
+    }
+
+    // A client on the same host asks for a ring channel
+    if (count == 3 && tokens[2] == "__ring__") {
+      boost::asio::post(_ioc,
+                        [this, ack, contents]() { attach_ring(contents); });
+      return true;
+    }
+
+    // Several calls in a single message
+    const bool batch = count == 3 && tokens[2] == "__batch__";
+
+    if (count != 5 && !batch) {
+      std::cerr << "Received message with invalid topic URI" << std::endl;
+      return true;
+    }
+
+    // Large requests arrive in chunks, if we announced to take them
+    if (_max_packet_size > 0 && is_chunk(contents)) {
+      bool complete = false;
+      try {
+        complete = reassemble(contents);
+      } catch (const std::exception& e) {
+        std::cerr << "Dropped chunk: " << e.what() << std::endl;
+      }
+      if (!complete) return true;
+    }
+
+    if (batch) {
+      boost::asio::post(_ioc,
+                        [this, ack, contents]() { handle_batch(contents); });
+      return true;
+    }
+
+    // Known topic levels resolve to interned strings, no allocation here
+    const auto klass = intern(tokens[2]);
+    const auto instance = intern(tokens[3]);
+    const auto function = intern(tokens[4]);
+
+    // MQTT v5 requests may carry their reply route as properties
+    ResponseRoute route;
+    const bool v5 = _mqtt5 && VrpcAgent::response_route(props, route);
+
+    // Levels never seen name no target (e.g. a deleted instance)
+    if (!klass || !instance || !function) {
+      boost::asio::post(_ioc, [this, ack, contents, route, v5,
+                               k = std::string(tokens[2]),
+                               i = std::string(tokens[3]),
+                               f = std::string(tokens[4])]() {
+        if (v5) {
+          respond(route, "", route_error(k, i, f),
+                  function_qos(k, f, _reply_qos));
+        } else {
+          reject(k, i, f, contents);
+        }
+      });
+      return true;
+    }
+
+    if (v5) {
+      boost::asio::post(_ioc, [this, ack, contents, klass, instance, function,
+                               route]() {
+        handle_v5_call(*klass, *instance, *function, contents, route);
+      });
+      return true;
+    }
+
+    // call execution will be handled by the event-loop
+    boost::asio::post(_ioc, [this, ack, topic_b, contents, klass, instance,
+                             function]() {
+      const std::string& context =
+          *instance == "__static__" ? *klass : *instance;
+      if (_wildcard_subscriptions &&
+          !is_routable(*klass, *instance, *function)) {
+        reject(*klass, *instance, *function, contents);
+        return;
+      }
+      // Raw functions receive the plain payload, no json involved
+      if (handle_raw_call(topic_b, context, *function, contents,
+                          function_qos(*klass, *function, _reply_qos))) {
+        return;
+      }
+      json j;
+      bool one_way;
+      std::string sender;
+      try {
+        j = decode(contents);
+        one_way = is_one_way(*klass, *function, j);
+        // one-way calls don't need a sender
+        sender = one_way ? j.value("s", std::string())
+                         : j.at("s").get<std::string>();
+      } catch (const std::exception& e) {
+        // without a sender there is nobody to answer
+        std::cerr << "Dropped malformed message: " << e.what() << std::endl;
+        return;
+      }
+      if (!owns_lifetime_call(*klass, *function, j)) return;
+      if (VrpcAgent::refuse_isolated(*function, sender, j)) {
+        report_error(j);
+        return;
+      }
+      if (!sender.empty() && j.find("g") != j.end()) {
+        accept_coalescing(sender);
+      }
+      // set context for correct call
+      j["c"] = context;
+      // set function
+      j["f"] = *function;
+
+      execute(*klass, *function, sender, j);
+
+      if (one_way) {
+        report_error(j);
+        return;
+      }
+      // RPC answer goes here
+      reply(sender, encode(j), function_qos(*klass, *function, _reply_qos));
+    });
+    return true;
+  }
+
+  // Calls carrying their reply route as MQTT v5 properties (response topic
+  // and correlation data). The payload only holds the arguments (json array)
+  // and the reply only the result, errors are sent as user property "e".
+  void handle_v5_call(const std::string& klass,
+                      const std::string& instance,
+                      const std::string& function,
+                      const mqtt::buffer& contents,
+                      const ResponseRoute& route) {
+    const mqtt::qos qos = function_qos(klass, function, _reply_qos);
+    // unknown targets are rejected without looking at the payload
+    if (_wildcard_subscriptions && !is_routable(klass, instance, function)) {
+      respond(route, "", route_error(klass, instance, function), qos);
+      return;
+    }
+    const std::string& context = instance == "__static__" ? klass : instance;
+    std::string result;
+    try {
+      if (LocalFactory::call_raw(context, function, contents.data(),
+                                 contents.size(), result)) {
+        respond(route, std::move(result), "", qos);
+        return;
+      }
+    } catch (const std::exception& e) {
+      respond(route, "", e.what(), qos);
+      return;
+    }
+    json j{{"c", context}, {"f", function}, {"s", route.topic}};
+    try {
+      j["a"] = contents.empty() ? json::array()
+                                : json::parse(contents.begin(), contents.end());
+    } catch (const std::exception& e) {
+      respond(route, "", std::string("Invalid arguments: ") + e.what(), qos);
+      return;
+    }
+    if (!j["a"].is_array()) {
+      respond(route, "", "Invalid arguments: expected a json array", qos);
+      return;
+    }
+    // lifetimes are tied to the client, as with regular calls
+    if (function == "__createIsolated__" && route.client.empty()) {
+      respond(route, "",
+              "Isolated instances need the client id as user property \"s\"",
+              qos);
+      return;
+    }
+    if (!owns_lifetime_call(klass, function, j)) return;
+    execute(klass, function, route.client, j);
+    const auto e = j.find("e");
+    if (e != j.end()) {
+      respond(route, "", e->is_string() ? e->get<std::string>() : e->dump(),
+              qos);
+    } else {
+      respond(route, j.value("r", json()).dump(), "", qos);
+    }
+  }
+
+  void respond(const ResponseRoute& route,
+               std::string payload,
+               const std::string& error,
+               mqtt::qos qos) {
+    mqtt::v5::properties props;
+    if (!route.correlation.empty()) {
+      // binary data, no utf-8 check
+      props.push_back(mqtt::v5::property::correlation_data(
+          mqtt::allocate_buffer(route.correlation), true));
+    }
+    if (!error.empty()) {
+      props.push_back(mqtt::v5::property::user_property(
+          mqtt::allocate_buffer("e"), mqtt::allocate_buffer(error)));
+    }
+    send(route.topic, std::move(payload), qos, std::move(props));
+  }
+
+  static bool response_route(const mqtt::v5::properties& props,
+                             ResponseRoute& route) {
+    for (const auto& prop : props) {
+      mqtt::visit(
+          mqtt::make_lambda_visitor(
+              [&](const mqtt::v5::property::response_topic& p) {
+                route.topic = std::string(p.val());
+              },
+              [&](const mqtt::v5::property::correlation_data& p) {
+                route.correlation = std::string(p.val());
+              },
+              [&](const mqtt::v5::property::user_property& p) {
+                if (p.key() == "s") route.client = std::string(p.val());
+              },
+              [](const auto&) {}),
+          prop);
+    }
+    return !route.topic.empty();
+  }
+
+  // Performs a call (mutating j) and keeps track of created and deleted
+  // instances
+  void execute(const std::string& klass,
+               const std::string& function,
+               const std::string& sender,
+               json& j) {
+    // Requests failing to decode (e.g. shared memory) carry their error
+    if (j.find("e") != j.end()) return;
+    // The actual call to the existing code
+    // NOTE: the json object is mutated during the call
+    LocalFactory::call(j);
+
+    // Lifetime handling
+    if (function == "__createIsolated__" && j["r"].is_string()) {
+      // Return value = instance
+      const std::string instance(j["r"].get<std::string>());
+      subscribe_to_instance(klass, instance);
+      register_isolated_instance(instance, klass, sender);
+    } else if (function == "__createShared__" && j["r"].is_string()) {
+      const std::string instance(j["r"].get<std::string>());
+      subscribe_to_instance(klass, instance);
+      // Publish classInfo message (as number of instances changed)
+      publish_class_info(klass);
+    } else if (function == "__delete__" && j["r"] == true) {
+      // First argument = instance
+      const std::string instance(j["a"][0].get<std::string>());
+      unsubscribe_from_instance(klass, instance);
+      publish_class_info(klass);
+      unregister_isolated_instance(instance, klass, sender);
+    }
+    if (VrpcAgent::is_lifetime_function(function)) publish_pool_member();
+  }
+
+  // Executes the calls ("b") of a batch in order and answers them all in a
+  // single json array. Contexts and arguments may refer to the result of an
+  // earlier call of the same batch using {"$ref": <index>}.
+  void handle_batch(const mqtt::buffer& contents) {
+    json j;
+    try {
+      j = decode(contents);
+    } catch (const std::exception& e) {
+      std::cerr << "Dropped malformed message: " << e.what() << std::endl;
+      return;
+    }
+    const bool one_way = j.find("o") != j.end() && j["o"] != false;
+    const auto s = j.find("s");
+    if (!one_way && (s == j.end() || !s->is_string())) return;
+    const std::string sender(j.value("s", std::string()));
+    if (!sender.empty() && j.find("g") != j.end()) {
+      accept_coalescing(sender);
+    }
+    const auto calls = j.find("b");
+    if (calls == j.end() || !calls->is_array()) {
+      j["e"] = "Invalid batch, expected an array of calls";
+      if (one_way) {
+        report_error(j);
+      } else {
+        reply(sender, encode(j), _reply_qos);
+      }
+      return;
+    }
+    json results = json::array();
+    for (auto& call : *calls) {
+      try {
+        // callbacks are sent to the sender of the batch
+        if (!sender.empty()) call["s"] = sender;
+        if (call.find("a") == call.end()) call["a"] = json::array();
+        VrpcAgent::resolve_references(call["c"], results);
+        VrpcAgent::resolve_references(call["a"], results);
+        const std::string context(call.at("c").get<std::string>());
+        const std::string function(call.at("f").get<std::string>());
+        if (!VrpcAgent::refuse_isolated(function, sender, call) &&
+            !refuse_pooled(context, function, call)) {
+          execute(context, function, sender, call);
+        }
+      } catch (const std::exception& e) {
+        call["e"] = std::string("Invalid call: ") + e.what();
+      }
+      if (one_way && call.find("o") == call.end()) call["o"] = j["o"];
+      if (one_way) report_error(call);
+      results.push_back(std::move(call));
+    }
+    if (!one_way) reply(sender, encode(results, j), _reply_qos);
+  }
+
+  // A call is one-way if flagged in its envelope ("o") or configured so
+  bool is_one_way(const std::string& klass,
+                  const std::string& function,
+                  const json& j) const {
+    const auto it = j.find("o");
+    if (it != j.end()) return *it != false;
+    return !_one_way_functions.empty() &&
+           _one_way_functions.count(klass + "::" + function) > 0;
+  }
+
+  // Isolated instances live as long as their client, calls without a sender
+  // (one-way, direct or ring frames) can't create them
+  static bool refuse_isolated(const std::string& function,
+                              const std::string& sender,
+                              json& j) {
+    if (function != "__createIsolated__" || !sender.empty()) return false;
+    j["e"] = "Isolated instances need the sender (\"s\") of the call";
+    return true;
+  }
+
+  // A batch reaches a single member of a pool, which neither holds all the
+  // instances nor owns all lifetime calls, so it only takes static functions
+  bool refuse_pooled(const std::string& context,
+                     const std::string& function,
+                     json& j) const {
+    if (_pool.empty()) return false;
+    if (_routes.find(context) != _routes.end() &&
+        !VrpcAgent::is_lifetime_function(function)) {
+      return false;
+    }
+    j["e"] = "Batches of a pool take static functions only";
+    return true;
+  }
+
+  // Publishes the failed one-way call j to the error topic, which is either
+  // given by the call ("o": "<topic>") or configured
+  void report_error(const json& j) {
+    if (j.find("e") == j.end()) return;
+    const auto it = j.find("o");
+    const std::string& topic = it != j.end() && it->is_string()
+                                   ? it->get_ref<const std::string&>()
+                                   : _error_topic;
+    if (topic.empty()) return;
+    send(topic, encode(j), _reply_qos);
+  }
+
+  // Replaces all {"$ref": <index>} within value by the result of the
+  // referenced call
+  static void resolve_references(json& value, const json& results) {
+    if (value.is_object()) {
+      const auto ref = value.find("$ref");
+      if (ref != value.end() && value.size() == 1) {
+        if (!ref->is_number_integer() || ref->get<std::int64_t>() < 0 ||
+            ref->get<std::size_t>() >= results.size()) {
+          throw std::runtime_error("reference to unknown call " + ref->dump());
+        }
+        const json& referenced = results[ref->get<std::size_t>()];
+        const auto result = referenced.find("r");
+        if (result == referenced.end() ||
+            referenced.find("e") != referenced.end()) {
+          throw std::runtime_error("referenced call " + ref->dump() + " failed");
+        }
+        value = *result;
+        return;
+      }
+    }
+    if (value.is_structured()) {
+      for (auto& element : value) {
+        VrpcAgent::resolve_references(element, results);
+      }
+    }
+  }
+
+  mqtt::qos function_qos(const std::string& klass,
+                         const std::string& function,
+                         mqtt::qos fallback) const {
+    if (_function_qos.empty()) return fallback;
+    const auto it = _function_qos.find(klass + "::" + function);
+    return it == _function_qos.end() ? fallback : it->second;
+  }
+
+  // QoS to subscribe a topic with
+  mqtt::qos topic_qos(const std::string& topic) const {
+    if (_function_qos.empty()) return _subscription_qos;
+    const auto filter = mqtt::parse_shared_subscription(
+        mqtt::buffer(mqtt::string_view(topic)));
+    std::array<mqtt::string_view, 5> tokens;
+    if (!filter || VrpcAgent::tokenize(filter->topic_filter, tokens) != 5) {
+      return _subscription_qos;
+    }
+    return function_qos(std::string(tokens[2]), std::string(tokens[4]),
+                        _subscription_qos);
+  }
+
+  void accept_coalescing(const std::string& topic) {
+    if (_coalesce_window.count() == 0) return;
+    std::lock_guard<std::mutex> lock(_coalescers_mutex);
+    if (_coalescers.find(topic) != _coalescers.end()) return;
+    auto& c = _coalescers
+                  .insert({topic, {"", 0, {}, 0, mqtt::qos::at_most_once}})
+                  .first->second;
+    arm_coalescer(topic, c,
+                  std::chrono::steady_clock::now() + VRPC_COALESCER_IDLE);
+  }
+
+  // Sends a reply or callback. Towards clients accepting it, a message
+  // following another one within the coalescing window is held back and
+  // sent together with the ones after it as a json array (frame). Sparse
+  // traffic thus goes out without delay, bursts in few messages.
+  void reply(const std::string& topic,
+             std::string payload,
+             mqtt::qos qos = mqtt::qos::at_least_once) {
+    std::string frame;
+    mqtt::qos frame_qos = qos;
+    {
+      std::lock_guard<std::mutex> lock(_coalescers_mutex);
+      const auto it = _coalescers.find(topic);
+      if (it != _coalescers.end()) {
+        Coalescer& c = it->second;
+        // binary (compressed) and large payloads are never grouped
+        const bool groupable = !payload.empty() && payload.front() == '{' &&
+                               payload.size() + 2 <= _coalesce_max_bytes;
+        const auto now = std::chrono::steady_clock::now();
+        if (!groupable || (c.frame.empty() && now - c.last >= _coalesce_window)) {
+          c.last = now;
+          frame = take_frame(c, frame_qos);
+        } else {
+          c.last = now;
+          if (c.frame.size() + payload.size() + 2 > _coalesce_max_bytes) {
+            frame = take_frame(c, frame_qos);
+          }
+          // a new group goes out after one window at the latest
+          if (c.frame.empty()) arm_coalescer(topic, c, now + _coalesce_window);
+          c.frame += c.frame.empty() ? '[' : ',';
+          c.frame += payload;
+          payload.clear();
+          // a group is sent with the highest QoS of its messages
+          c.qos = std::max(c.qos, qos);
+          if (++c.count == _coalesce_max_count) {
+            frame = take_frame(c, frame_qos);
+          }
+        }
+      }
+    }
+    // the held back frame always goes out first to keep the order
+    if (!frame.empty()) send(topic, std::move(frame), frame_qos);
+    if (!payload.empty()) send(topic, std::move(payload), qos);
+  }
+
+  static std::string take_frame(Coalescer& c, mqtt::qos& qos) {
+    std::string frame;
+    if (c.frame.empty()) return frame;
+    frame.swap(c.frame);
+    frame += ']';
+    c.count = 0;
+    qos = c.qos;
+    c.qos = mqtt::qos::at_most_once;
+    return frame;
+  }
+
+  // Sends the group held back at when, afterwards the coalescer waits for
+  // the client to go quiet and is dropped then (caller holds the lock)
+  void arm_coalescer(const std::string& topic,
+                     Coalescer& c,
+                     std::chrono::steady_clock::time_point when) {
+    const std::size_t generation = ++c.generation;
+    auto timer = std::make_shared<boost::asio::steady_timer>(_ioc, when);
+    timer->async_wait([this, topic, timer,
+                       generation](const boost::system::error_code&) {
+      std::string frame;
+      mqtt::qos qos = _reply_qos;
+      {
+        std::lock_guard<std::mutex> lock(_coalescers_mutex);
+        const auto it = _coalescers.find(topic);
+        if (it == _coalescers.end() || it->second.generation != generation) {
+          return;
+        }
+        Coalescer& c = it->second;
+        frame = take_frame(c, qos);
+        const auto idle = c.last + VRPC_COALESCER_IDLE;
+        if (frame.empty() && std::chrono::steady_clock::now() >= idle) {
+          _coalescers.erase(it);
+          return;
+        }
+        arm_coalescer(topic, c, idle);
+      }
+      if (!frame.empty()) send(topic, std::move(frame), qos);
+    });
+  }
+
+  void publish(const std::string& topic,
+               std::string payload,
+               mqtt::publish_options options) {
+    const std::size_t size = count_sent(topic, payload.size());
+    if (_embedded_broker) {
+      _embedded_broker->publish(topic, std::move(payload), options, {},
+                                [this, size]() { on_sent(size); });
+      return;
+    }
+    _client->async_publish(topic, std::move(payload), options,
+                           [this, size](mqtt::error_code) { on_sent(size); });
+  }
+
+  void publish(const std::string& topic,
+               std::string payload,
+               mqtt::publish_options options,
+               mqtt::v5::properties props) {
+    const std::size_t size = count_sent(topic, payload.size());
+    if (_embedded_broker) {
+      _embedded_broker->publish(topic, std::move(payload), options,
+                                std::move(props),
+                                [this, size]() { on_sent(size); });
+      return;
+    }
+    _client->async_publish(topic, std::move(payload), options,
+                           std::move(props), mqtt::any(),
+                           [this, size](mqtt::error_code) { on_sent(size); });
+  }
+
+  // Returns a handle acknowledging the (QoS 1) message when released. As
+  // long as a call is in progress the broker holds back further messages
+  // exceeding the receive maximum.
+  std::shared_ptr<void> acknowledgement(
+      mqtt::optional<packet_id_t> packet_id) {
+    if (_max_inflight_calls == 0) return nullptr;
+    ++_inflight_calls;
+    return std::shared_ptr<void>(nullptr, [this, packet_id](void*) {
+      --_inflight_calls;
+      if (packet_id) acknowledge(*packet_id);
+    });
+  }
+
+  // Acknowledgements are deferred while too many bytes wait to be sent
+  void acknowledge(packet_id_t packet_id) {
+    {
+      std::lock_guard<std::mutex> lock(_acks_mutex);
+      if (_max_pending_bytes > 0 && _pending_bytes > _max_pending_bytes) {
+        _deferred_acks.push_back(packet_id);
+        return;
+      }
+    }
+    _client->async_puback(packet_id);
+  }
+
+  void on_sent(std::size_t size) {
+    _pending_bytes -= size;
+    std::vector<packet_id_t> acks;
+    {
+      std::lock_guard<std::mutex> lock(_acks_mutex);
+      if (_deferred_acks.empty() || _pending_bytes > _max_pending_bytes) {
+        return;
+      }
+      acks.swap(_deferred_acks);
+    }
+    for (const auto packet_id : acks) _client->async_puback(packet_id);
+  }
+
+  // Returns the number of bytes the message adds to the send queue
+  std::size_t count_sent(const std::string& topic, std::size_t size) {
+    size += topic.size();
+    _pending_bytes += size;
+    std::lock_guard<std::mutex> lock(_statistics_mutex);
+    ++_statistics.messages_sent;
+    _statistics.bytes_sent += size;
+    if (_topic_alias_maximum == 0) return size;
+    // an alias is a property of 3 bytes, used instead of the topic once
+    // registered
+    const auto it = _alias_index.find(topic);
+    if (it != _alias_index.end()) {
+      _alias_lru.splice(_alias_lru.begin(), _alias_lru, it->second);
+      ++_statistics.topic_aliases_used;
+      _statistics.bytes_saved += static_cast<std::int64_t>(topic.size()) - 3;
+      return size;
+    }
+    if (_alias_lru.size() == _topic_alias_maximum) {
+      _alias_index.erase(_alias_lru.back());
+      _alias_lru.pop_back();
+    }
+    _alias_lru.push_front(topic);
+    _alias_index[topic] = _alias_lru.begin();
+    _statistics.bytes_saved -= 3;
+    return size;
+  }
+
+  // The endpoint starts over with topic aliases on every connection
+  void reset_topic_aliases(std::size_t maximum) {
+    std::lock_guard<std::mutex> lock(_statistics_mutex);
+    _topic_alias_maximum = maximum;
+    _alias_lru.clear();
+    _alias_index.clear();
+  }
+
+  static std::size_t topic_alias_maximum(const mqtt::v5::properties& props) {
+    std::size_t maximum = 0;
+    for (const auto& prop : props) {
+      mqtt::visit(
+          mqtt::make_lambda_visitor(
+              [&](const mqtt::v5::property::topic_alias_maximum& p) {
+                maximum = p.val();
+              },
+              [](const auto&) {}),
+          prop);
+    }
+    return maximum;
+  }
+
+  mqtt::v5::properties connect_properties() const {
+    mqtt::v5::properties props{
+        mqtt::v5::property::topic_alias_maximum(_topic_alias_receive_maximum)};
+    if (_max_inflight_calls > 0) {
+      props.push_back(mqtt::v5::property::receive_maximum(
+          static_cast<std::uint16_t>(std::min<std::size_t>(
+              _max_inflight_calls, std::numeric_limits<std::uint16_t>::max()))));
+    }
+    // v5 sessions end with the connection unless given an expiry
+    if (_persistent_session) {
+      props.push_back(mqtt::v5::property::session_expiry_interval(
+          mqtt::session_never_expire));
+    }
+    return props;
+  }
+
+  // Chunks are always sent with QoS 1, a single lost chunk would render the
+  // whole transfer useless
+  void send(const std::string& topic,
+            std::string payload,
+            mqtt::qos qos = mqtt::qos::at_least_once,
+            mqtt::v5::properties props = {}) {
+    const std::size_t capacity = packet_capacity(topic, props);
+    if (_max_packet_size == 0 || payload.size() <= capacity) {
+      if (props.empty()) {
+        publish(topic, std::move(payload), qos);
+      } else {
+        publish(topic, std::move(payload), qos, std::move(props));
+      }
+      return;
+    }
+    if (capacity <= VRPC_CHUNK_HEADER_SIZE) {
+      std::cerr << "Dropped message, topic too long for max_packet_size: "
+                << topic << std::endl;
+      return;
+    }
+    const std::size_t chunk_size = capacity - VRPC_CHUNK_HEADER_SIZE;
+    const std::uint32_t total = static_cast<std::uint32_t>(
+        (payload.size() + chunk_size - 1) / chunk_size);
+    bool idle;
+    {
+      std::lock_guard<std::mutex> lock(_transfers_mutex);
+      idle = _transfers.empty();
+      _transfers.push_back({topic, std::move(payload), _transfer_id++, 0,
+                            total, chunk_size, std::move(props)});
+    }
+    if (idle) {
+      boost::asio::post(_ioc, [this]() { send_next_chunk(); });
+    }
+  }
+
+  // Sends one chunk of the oldest transfer and re-posts itself, giving other
+  // (small) messages the chance to be sent in between
+  void send_next_chunk() {
+    std::string topic;
+    std::string frame;
+    mqtt::v5::properties props;
+    {
+      std::lock_guard<std::mutex> lock(_transfers_mutex);
+      if (_transfers.empty()) return;
+      Transfer& t = _transfers.front();
+      const std::size_t chunk_size = t.chunk_size;
+      const std::size_t offset = std::size_t(t.next) * chunk_size;
+      frame.reserve(VRPC_CHUNK_HEADER_SIZE + chunk_size);
+      frame += VRPC_CHUNK_MAGIC;
+      VrpcAgent::append_le(frame, t.id, 8);
+      VrpcAgent::append_le(frame, t.next, 4);
+      VrpcAgent::append_le(frame, t.total, 4);
+      frame.append(t.payload, offset, chunk_size);
+      topic = t.topic;
+      props = t.props;
+      // round robin between concurrent transfers
+      Transfer current(std::move(t));
+      _transfers.pop_front();
+      if (++current.next < current.total) {
+        _transfers.push_back(std::move(current));
+      }
+    }
+    if (props.empty()) {
+      publish(topic, std::move(frame), mqtt::qos::at_least_once);
+    } else {
+      publish(topic, std::move(frame), mqtt::qos::at_least_once,
+              std::move(props));
+    }
+    boost::asio::post(_ioc, [this]() { send_next_chunk(); });
+  }
+
+  // Payload bytes fitting a PUBLISH to topic within max_packet_size: fixed
+  // header (at most 5), topic (2 + length), packet id (2) and the v5
+  // properties (length prefix of at most 4, or 1 if there are none)
+  std::size_t packet_capacity(const std::string& topic,
+                              const mqtt::v5::properties& props = {}) const {
+    std::size_t overhead = 5 + 2 + topic.size() + 2 + 1;
+    for (const auto& prop : props) overhead += mqtt::v5::size(prop);
+    if (!props.empty()) overhead += 3;
+    return _max_packet_size > overhead ? _max_packet_size - overhead : 0;
+  }
+
+  static bool is_chunk(const mqtt::buffer& contents) {
+    return contents.size() >= VRPC_CHUNK_HEADER_SIZE &&
+           contents.compare(0, sizeof(VRPC_CHUNK_MAGIC) - 1,
+                            VRPC_CHUNK_MAGIC) == 0;
+  }
+
+  // Collects a chunk, returns true (and replaces contents with the full
+  // payload) once the transfer is complete
+  bool reassemble(mqtt::buffer& contents) {
+    const char* header = contents.data() + sizeof(VRPC_CHUNK_MAGIC) - 1;
+    const std::uint64_t id = VrpcAgent::read_le(header, 8);
+    const std::uint32_t seq =
+        static_cast<std::uint32_t>(VrpcAgent::read_le(header + 8, 4));
+    const std::uint32_t total =
+        static_cast<std::uint32_t>(VrpcAgent::read_le(header + 12, 4));
+    const std::size_t size = contents.size() - VRPC_CHUNK_HEADER_SIZE;
+    const auto now = std::chrono::steady_clock::now();
+    // forget about transfers that stalled
+    for (auto it = _reassemblies.begin(); it != _reassemblies.end();) {
+      if (now - it->second.updated > std::chrono::minutes(1)) {
+        it = forget_reassembly(it);
+      } else {
+        ++it;
+      }
+    }
+    auto it = _reassemblies.find(id);
+    if (size == 0 || total < 2 || seq >= total ||
+        total > VRPC_MAX_PAYLOAD_SIZE / size + 1 ||
+        (it != _reassemblies.end() &&
+         (total != it->second.total || it->second.chunks.count(seq) != 0))) {
+      std::cerr << "Received malformed chunk" << std::endl;
+      if (it != _reassemblies.end()) forget_reassembly(it);
+      return false;
+    }
+    if (it == _reassemblies.end()) {
+      if (_reassemblies.size() >= VRPC_MAX_REASSEMBLIES) {
+        std::cerr << "Dropped chunk, too many transfers in progress"
+                  << std::endl;
+        return false;
+      }
+      it = _reassemblies.emplace(id, Reassembly{{}, total, 0, now}).first;
+    }
+    Reassembly& r = it->second;
+    const std::size_t cost = size + VRPC_CHUNK_OVERHEAD;
+    if (r.bytes + cost > VRPC_MAX_PAYLOAD_SIZE ||
+        _reassembly_bytes + cost > VRPC_MAX_REASSEMBLY_BYTES) {
+      std::cerr << "Dropped chunked transfer exceeding "
+                << VRPC_MAX_REASSEMBLY_BYTES << " bytes" << std::endl;
+      forget_reassembly(it);
+      return false;
+    }
+    r.chunks.emplace(seq,
+                     std::string(contents.data() + VRPC_CHUNK_HEADER_SIZE,
+                                 size));
+    r.bytes += cost;
+    _reassembly_bytes += cost;
+    r.updated = now;
+    if (r.chunks.size() < r.total) return false;
+    const std::map<std::uint32_t, std::string> chunks(std::move(r.chunks));
+    forget_reassembly(it);
+    std::string payload;
+    for (const auto& chunk : chunks) payload += chunk.second;
+    contents = mqtt::allocate_buffer(payload);
+    return true;
+  }
+
+  std::unordered_map<std::uint64_t, Reassembly>::iterator forget_reassembly(
+      std::unordered_map<std::uint64_t, Reassembly>::iterator it) {
+    _reassembly_bytes -= it->second.bytes;
+    return _reassemblies.erase(it);
+  }
+
+  static void append_le(std::string& out, std::uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+      out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+    }
+  }
+
+  static std::uint64_t read_le(const char* in, int bytes) {
+    std::uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) {
+      value |= std::uint64_t(static_cast<unsigned char>(in[i])) << (8 * i);
+    }
+    return value;
+  }
+
+  json decode(const mqtt::buffer& contents) const {
+    const std::size_t header = sizeof(VRPC_LZ4_MAGIC) - 1 + 4;
+    json j;
+    // compressed payloads are only expected if we announced lz4
+    if (_compression_threshold == 0 || contents.size() < header ||
+        contents.compare(0, header - 4, VRPC_LZ4_MAGIC) != 0) {
+      // TODO try witout string
+      j = json::parse(std::string(contents));
+    } else {
+      const std::size_t size =
+          VrpcAgent::read_le(contents.data() + header - 4, 4);
+      if (size > VRPC_MAX_PAYLOAD_SIZE) {
+        throw std::runtime_error("Received lz4 payload exceeding " +
+                                 std::to_string(VRPC_MAX_PAYLOAD_SIZE) +
+                                 " bytes");
+      }
+      std::string plain;
+      if (!lz4::decompress(contents.data() + header, contents.size() - header,
+                           size, plain)) {
+        throw std::runtime_error("Received malformed lz4 payload");
+      }
+      j = json::parse(plain);
+      // a compressing client also accepts compressed answers
+      j["z"] = "lz4";
+    }
+    // Large requests of local clients are placed in shared memory
+    const auto it = j.find("m");
+    if (_shm_threshold > 0 && it != j.end() && j.find("a") == j.end()) {
+      try {
+        j = json::parse(read_shared_memory(*it));
+      } catch (const std::exception& e) {
+        // answered as failed call, the envelope still names the sender
+        j.erase(it);
+        j["e"] = e.what();
+      }
+    }
+    return j;
+  }
+
+  std::string encode(const json& j) { return encode(j, j); }
+
+  // Serializes j, the transport flags are taken from the request envelope
+  std::string encode(const json& j, const json& envelope) {
+    std::string payload(dump(j));
+    if (_shm_threshold > 0 && payload.size() >= _shm_threshold &&
+        is_local_client(envelope)) {
+      json handle;
+      if (write_shared_memory(payload, handle)) {
+        json k{{"m", handle}};
+        if (envelope.find("i") != envelope.end()) k["i"] = envelope["i"];
+        return k.dump();
+      }
+    }
+    if (_compression_threshold == 0 || payload.size() < _compression_threshold ||
+        envelope.find("z") == envelope.end()) {
+      return payload;
+    }
+    const std::string block(lz4::compress(payload.data(), payload.size()));
+    const std::size_t header = sizeof(VRPC_LZ4_MAGIC) - 1 + 4;
+    if (block.size() + header >= payload.size()) {
+      return payload;
+    }
+    std::string out(VRPC_LZ4_MAGIC);
+    out.reserve(header + block.size());
+    VrpcAgent::append_le(out, payload.size(), 4);
+    out += block;
+    return out;
+  }
+
+  bool is_local_client(const json& j) const {
+    const auto it = j.find("h");
+    return it != j.end() && it->is_string() &&
+           it->get<std::string>() == _hostname;
+  }
+
+#ifdef VRPC_HAS_SHM
+
+  bool write_shared_memory(const std::string& payload, json& handle) {
+    const std::string name(_shm_prefix + std::to_string(::getpid()) + "-" +
+                           std::to_string(_shm_counter++));
+    const int fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) return false;
+    void* addr = MAP_FAILED;
+    if (::ftruncate(fd, payload.size()) == 0) {
+      addr = ::mmap(nullptr, payload.size(), PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+      ::shm_unlink(name.c_str());
+      return false;
+    }
+    std::memcpy(addr, payload.data(), payload.size());
+    ::munmap(addr, payload.size());
+    handle = {{"name", name}, {"size", payload.size()}};
+    _VRPC_DEBUG << "Placed " << payload.size() << " bytes in " << name
+                << std::endl;
+    bool first;
+    {
+      std::lock_guard<std::mutex> lock(_shm_mutex);
+      first = _shm_segments.empty();
+      _shm_segments.emplace_back(std::chrono::steady_clock::now(), name);
+    }
+    if (first) {
+      boost::asio::post(_ioc, [this]() { sweep_shared_memory(false); });
+    }
+    return true;
+  }
+
+  // Unlinks the segments nobody read within a minute (all if forced), the
+  // timer re-arms itself while segments are left
+  void sweep_shared_memory(bool all) {
+    const auto ttl = std::chrono::minutes(1);
+    const auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(_shm_mutex);
+    while (!_shm_segments.empty() &&
+           (all || now - _shm_segments.front().first >= ttl)) {
+      // the reader may have unlinked it already
+      ::shm_unlink(_shm_segments.front().second.c_str());
+      _shm_segments.pop_front();
+    }
+    if (all) {
+      if (_shm_timer) _shm_timer->cancel();
+      return;
+    }
+    if (_shm_segments.empty()) return;
+    if (!_shm_timer) _shm_timer.reset(new boost::asio::steady_timer(_ioc));
+    _shm_timer->expires_at(_shm_segments.front().first + ttl);
+    _shm_timer->async_wait([this](const boost::system::error_code& ec) {
+      if (!ec) sweep_shared_memory(false);
+    });
+  }
+
+  // Reads a request a local client placed in shared memory, the handle is
+  // checked before the segment is touched
+  std::string read_shared_memory(const json& handle) const {
+    const std::string name(handle.at("name").get<std::string>());
+    const std::size_t size = handle.at("size").get<std::size_t>();
+    if (name.size() <= _shm_prefix.size() || name.size() > NAME_MAX ||
+        name.compare(0, _shm_prefix.size(), _shm_prefix) != 0 ||
+        name.find('/', 1) != std::string::npos) {
+      throw std::runtime_error("Invalid shared memory name: " + name);
+    }
+    if (size > VRPC_MAX_PAYLOAD_SIZE) {
+      throw std::runtime_error("Shared memory request exceeds " +
+                               std::to_string(VRPC_MAX_PAYLOAD_SIZE) +
+                               " bytes");
+    }
+    const int fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+      throw std::runtime_error("Failed opening shared memory: " + name);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || std::size_t(st.st_size) < size) {
+      ::close(fd);
+      throw std::runtime_error("Shared memory smaller than announced: " +
+                               name);
+    }
+    // the reader releases the segment
+    ::shm_unlink(name.c_str());
+    // read() instead of mmap, a segment shrinking meanwhile can't fault
+    std::string payload(size, '\0');
+    std::size_t done = 0;
+    while (done < size) {
+      const ssize_t n = ::pread(fd, &payload[done], size - done, done);
+      if (n <= 0) break;
+      done += n;
+    }
+    ::close(fd);
+    if (done < size) {
+      throw std::runtime_error("Failed reading shared memory: " + name);
+    }
+    return payload;
+  }
+
+#else
+
+  bool write_shared_memory(const std::string&, json&) { return false; }
+
+  void sweep_shared_memory(bool) {}
+
+  std::string read_shared_memory(const json&) const {
+    throw std::runtime_error("Shared memory is not supported on this platform");
+  }
+
+#endif
+
+  std::string dump(const json& j) const {
+    const auto it = j.find("r");
+    if (_parallel_dump_threshold == 0 || it == j.end() || !it->is_array() ||
+        it->size() < _parallel_dump_threshold) {
+      return j.dump();
+    }
+    // envelope members (everything but the result) are small
+    std::string out("{");
+    for (auto member = j.begin(); member != j.end(); ++member) {
+      if (member.key() == "r") continue;
+      out += json(member.key()).dump() + ":" + member.value().dump() + ",";
+    }
+    out += "\"r\":";
+    out += VrpcAgent::parallel_dump(*it, _parallel_dump_threads);
+    out += "}";
+    return out;
+  }
+
+  static std::string parallel_dump(const json& array, unsigned threads) {
+    const std::size_t size = array.size();
+    const std::size_t chunk = (size + threads - 1) / threads;
+    std::vector<std::future<std::string>> parts;
+    for (std::size_t begin = 0; begin < size; begin += chunk) {
+      const std::size_t end = std::min(size, begin + chunk);
+      parts.push_back(std::async(std::launch::async, [&array, begin, end]() {
+        std::string part;
+        for (std::size_t i = begin; i < end; ++i) {
+          if (i != begin) part += ",";
+          part += array[i].dump();
+        }
+        return part;
+      }));
+    }
+    std::string out("[");
+    for (std::size_t i = 0; i < parts.size(); ++i) {
+      if (i != 0) out += ",";
+      out += parts[i].get();
+    }
+    out += "]";
+    return out;
+  }
+
+  static std::string remove_signature(const std::string& function) {
+    const size_t pos = function.find_first_of("-");
+    return pos == std::string::npos ? function : function.substr(0, pos);
+  }
+
+  void publish_class_info(const std::string& klass) {
+    json j;
+    j["className"] = klass;
+    j["instances"] = LocalFactory::get_instances(klass);
+    // the class info of a pool lists the shared instances of all members,
+    // ours are gone once we stop
+    if (!_pool.empty()) {
+      std::set<std::string> instances;
+      if (!_stopping) {
+        const auto local = LocalFactory::get_instances(klass);
+        instances.insert(local.begin(), local.end());
+      }
+      for (const auto& kv : _pool_members) {
+        const auto it = kv.second.shared.find(klass);
+        if (it != kv.second.shared.end()) {
+          instances.insert(it->second.begin(), it->second.end());
+        }
+      }
+      j["instances"] = instances;
+    }
+    j["memberFunctions"] = LocalFactory::get_member_functions(klass);
+    j["staticFunctions"] = LocalFactory::get_static_functions(klass);
+    j["meta"] = LocalFactory::get_meta_data(klass);
+    j["v"] = VRPC_PROTOCOL_VERSION;
+    publish(class_topic(klass) + "__classInfo__", j.dump(),
+            mqtt::qos::at_least_once | mqtt::retain::yes);
+  }
+
+  // Splits a topic into its levels, returns the number of levels found
+  // (N + 1 if there are more than N)
+  template <std::size_t N>
+  static std::size_t tokenize(mqtt::string_view topic,
+                              std::array<mqtt::string_view, N>& tokens) {
+    std::size_t count = 0;
+    std::size_t begin = 0;
+    while (begin <= topic.size()) {
+      std::size_t end = topic.find('/', begin);
+      if (end == mqtt::string_view::npos) end = topic.size();
+      if (end > begin) {
+        if (count == N) return N + 1;
+        tokens[count++] = topic.substr(begin, end - begin);
+      }
+      begin = end + 1;
+    }
+    return count;
+  }
+
+  // Returns nullptr for levels that are no known target
+  std::shared_ptr<const std::string> intern(mqtt::string_view level) const {
+    auto it = _interned.find(level);
+    if (it != _interned.end()) return it->second;
+    it = _interned_instances.find(level);
+    if (it != _interned_instances.end()) return it->second;
+    return nullptr;
+  }
+
+  static void add_interned(Interned& interned, const std::string& level) {
+    if (interned.find(level) != interned.end()) return;
+    auto str = std::make_shared<const std::string>(level);
+    interned.emplace(mqtt::string_view(*str), str);
+  }
+
+  void add_interned(const std::string& level) {
+    VrpcAgent::add_interned(_interned, level);
+  }
+
+  void intern_classes() {
+    add_interned("__static__");
+    for (const auto& klass : LocalFactory::get_classes()) {
+      add_interned(klass);
+      class_topic(klass);
+      ClassRoutes& routes = _routes[klass];
+      for (const auto& func : LocalFactory::get_static_functions(klass)) {
+        const std::string func_base(VrpcAgent::remove_signature(func));
+        add_interned(func_base);
+        routes.static_functions.insert(func_base);
+      }
+      for (const auto& func : LocalFactory::get_member_functions(klass)) {
+        const std::string func_base(VrpcAgent::remove_signature(func));
+        add_interned(func_base);
+        routes.member_functions.insert(func_base);
+      }
+    }
+  }
+
+  bool is_routable(const std::string& klass,
+                   const std::string& instance,
+                   const std::string& function) const {
+    const auto it = _routes.find(klass);
+    if (it == _routes.end()) return false;
+    const ClassRoutes& routes = it->second;
+    if (instance == "__static__") {
+      return routes.static_functions.count(function) > 0;
+    }
+    return routes.instances.count(instance) > 0 &&
+           routes.member_functions.count(function) > 0;
+  }
+
+  // Answers calls to unknown targets without touching the factory
+  void reject(const std::string& klass,
+              const std::string& instance,
+              const std::string& function,
+              const mqtt::buffer& contents) {
+    json j;
+    try {
+      j = decode(contents);
+    } catch (const std::exception& e) {
+      std::cerr << "Dropped malformed message: " << e.what() << std::endl;
+      return;
+    }
+    if (!j.is_object()) return;
+    j["e"] = route_error(klass, instance, function);
+    if (is_one_way(klass, function, j)) {
+      report_error(j);
+      return;
+    }
+    const auto sender = j.find("s");
+    if (sender == j.end() || !sender->is_string()) return;
+    reply(sender->get<std::string>(), encode(j), _reply_qos);
+  }
+
+  std::string route_error(const std::string& klass,
+                          const std::string& instance,
+                          const std::string& function) const {
+    const auto it = _routes.find(klass);
+    if (it == _routes.end()) {
+      return "Could not find class: " + klass;
+    }
+    if (instance != "__static__" && it->second.instances.count(instance) == 0) {
+      return "Could not find instance: " + instance;
+    }
+    return "Could not find function: " + function;
+  }
+
+  // Returns the (cached) topic prefix of a class, e.g. "vrpc/agent/Foo/"
+  const std::string& class_topic(const std::string& klass) {
+    const auto it = _class_topics.find(klass);
+    if (it != _class_topics.end()) return it->second;
+    return _class_topics.emplace(klass, _topic_prefix + klass + "/")
+        .first->second;
+  }
+
+  void subscribe_to_instance(const std::string& klass,
+                             const std::string& instance) {
+    VrpcAgent::add_interned(_interned_instances, instance);
+    _routes[klass].instances.insert(instance);
+    if (_wildcard_subscriptions) return;
+    const std::string prefix(class_topic(klass) + instance + "/");
+    std::vector<std::string> topics;
+    for (auto function : LocalFactory::get_member_functions(klass)) {
+      function = VrpcAgent::remove_signature(function);
+      topics.push_back(prefix + function);
+      _VRPC_DEBUG << "Subscribing to new topic: " << topics.back()
+                  << std::endl;
+    }
+    subscribe(topics);
+  }
+
+  void unsubscribe_from_instance(const std::string& klass,
+                                 const std::string& instance) {
+    _interned_instances.erase(instance);
+    _routes[klass].instances.erase(instance);
+    if (_wildcard_subscriptions) return;
+    const std::string prefix(class_topic(klass) + instance + "/");
+    std::vector<std::string> topics;
+    for (auto function : LocalFactory::get_member_functions(klass)) {
+      function = VrpcAgent::remove_signature(function);
+      topics.push_back(prefix + function);
+      _VRPC_DEBUG << "Unsubscribing from topic after deletion: "
+                  << topics.back() << std::endl;
+    }
+    unsubscribe(topics);
+  }
+
+  // Subscribes to many topics using few SUBSCRIBE packets
+  void subscribe(const std::vector<std::string>& topics) {
+    if (_embedded_broker) {
+      _embedded_broker->subscribe(topics);
+      return;
+    }
+    std::vector<std::tuple<std::string, mqtt::subscribe_options>> batch;
+    for (const auto& topic : topics) {
+      batch.emplace_back(topic, topic_qos(topic));
+      if (batch.size() == VRPC_SUBSCRIBE_BATCH_SIZE) {
+        _client->async_subscribe(std::move(batch));
+        batch.clear();
+      }
+    }
+    if (!batch.empty()) _client->async_subscribe(std::move(batch));
+  }
+
+  void unsubscribe(const std::vector<std::string>& topics) {
+    if (_embedded_broker) {
+      _embedded_broker->unsubscribe(topics);
+      return;
+    }
+    std::vector<std::string> batch;
+    for (const auto& topic : topics) {
+      batch.push_back(topic);
+      if (batch.size() == VRPC_SUBSCRIBE_BATCH_SIZE) {
+        _client->async_unsubscribe(std::move(batch));
+        batch.clear();
+      }
+    }
+    if (!batch.empty()) _client->async_unsubscribe(std::move(batch));
+  }
+
+  std::chrono::milliseconds next_reconnect_delay() {
+    const std::size_t exponent = std::min<std::size_t>(_reconnect_attempt++, 20);
+    const std::size_t cap =
+        std::min(_reconnect_max_ms, _reconnect_min_ms << exponent);
+    // "equal jitter": half of the delay is fixed, half is random
+    std::uniform_int_distribution<std::size_t> jitter(0, cap / 2);
+    return std::chrono::milliseconds(cap - cap / 2 + jitter(_random));
   }
 
   void register_isolated_instance(const std::string& instance,
@@ -542,8 +2694,7 @@ class VrpcAgent {
       it->second.insert({instance, klass});
     } else {  // new client
       _isolated_instances[client_id].insert({instance, klass});
-      _client->subscribe(client_id + "/__clientInfo__",
-                         mqtt::qos::at_least_once);
+      subscribe({client_id + "/__clientInfo__"});
     }
     _VRPC_DEBUG << "Tracking lifetime of client: " << client_id << std::endl;
   }
@@ -559,7 +2710,8 @@ class VrpcAgent {
     }
     it->second.erase({instance, klass});
     if (it->second.size() == 0) {
-      _client->unsubscribe(client_id + "/__clientInfo__");
+      _isolated_instances.erase(it);
+      unsubscribe({client_id + "/__clientInfo__"});
       _VRPC_DEBUG << "Stopped tracking lifetime of client: " << client_id
                   << std::endl;
     }
@@ -0,0 +1,502 @@
+/*
+Minimal MQTT broker on top of the vendored mqtt_cpp server.
+
+Used by the agent to host the broker in its own process (see
+Options::embedded_broker_port). Clients connect through TCP on the loopback
+interface, the agent itself publishes and subscribes in memory. Supports
+MQTT 3.1.1 and 5, wildcards, shared subscriptions, retained messages and
+wills. Sessions end with their connection, there is no authentication.
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+*/
+
+#ifndef VRPC_BROKER_HPP
+#define VRPC_BROKER_HPP
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <vrpc/mqtt.hpp>
+#include <vrpc/mqtt/server.hpp>
+
+namespace vrpc {
+
+class Broker {
+ public:
+  typedef mqtt::server<>::endpoint_t Endpoint;
+  typedef mqtt::server<>::endpoint_t::packet_id_t packet_id_t;
+
+  // Receives messages matching the local subscriptions
+  typedef std::function<void(mqtt::buffer topic,
+                             mqtt::buffer contents,
+                             mqtt::v5::properties props)>
+      LocalHandler;
+
+ private:
+  struct Session {
+    // empty for the local subscriber
+    std::shared_ptr<Endpoint> endpoint;
+    std::string client_id;
+    mqtt::optional<mqtt::will> will;
+    // share name (empty if not shared) and topic filter
+    std::set<std::pair<std::string, std::string>> subscriptions;
+  };
+
+  struct Subscriber {
+    Session* session;
+    mqtt::qos qos;
+  };
+
+  // Members of a share group take turns, others all receive the message
+  struct Group {
+    std::vector<Subscriber> members;
+    std::size_t next = 0;
+  };
+
+  struct Retained {
+    mqtt::buffer contents;
+    mqtt::qos qos;
+    mqtt::v5::properties props;
+  };
+
+  boost::asio::io_context& _ioc;
+  mqtt::server<> _server;
+  Session _local;
+  LocalHandler _local_handler;
+  std::unordered_map<Endpoint*, std::unique_ptr<Session>> _sessions;
+  std::unordered_map<std::string, Session*> _client_ids;
+  // topic filter -> share name -> subscribers
+  std::unordered_map<std::string, std::map<std::string, Group>> _filters;
+  std::set<std::string> _wildcards;
+  std::map<std::string, Retained> _retained;
+
+ public:
+  Broker(boost::asio::io_context& ioc, std::uint16_t port)
+      : _ioc(ioc),
+        _server(boost::asio::ip::tcp::endpoint(
+                    boost::asio::ip::address_v4::loopback(), port),
+                ioc) {
+    _server.set_accept_handler(
+        [this](std::shared_ptr<Endpoint> ep) { accept(std::move(ep)); });
+    _server.set_error_handler([](mqtt::error_code ec) {
+      std::cerr << "Embedded broker stopped accepting: " << ec.message()
+                << std::endl;
+    });
+    _server.listen();
+  }
+
+  std::uint16_t port() const { return _server.port(); }
+
+  void set_local_handler(LocalHandler handler) {
+    _local_handler = std::move(handler);
+  }
+
+  // The local API may be used from any thread, work is done by the
+  // event-loop in order of the calls
+
+  void subscribe(const std::vector<std::string>& filters) {
+    boost::asio::post(_ioc, [this, filters]() {
+      for (const auto& filter : filters) {
+        const auto sf = mqtt::parse_shared_subscription(
+            mqtt::buffer(mqtt::string_view(filter)));
+        if (!sf) continue;
+        add(_local, std::string(sf->share_name), std::string(sf->topic_filter),
+            mqtt::qos::exactly_once);
+        deliver_retained(_local, std::string(sf->topic_filter),
+                         mqtt::qos::exactly_once);
+      }
+    });
+  }
+
+  void unsubscribe(const std::vector<std::string>& filters) {
+    boost::asio::post(_ioc, [this, filters]() {
+      for (const auto& filter : filters) {
+        const auto sf = mqtt::parse_shared_subscription(
+            mqtt::buffer(mqtt::string_view(filter)));
+        if (!sf) continue;
+        remove(_local, std::string(sf->share_name),
+               std::string(sf->topic_filter));
+      }
+    });
+  }
+
+  // Calls sent once the message is written to all remote subscribers
+  void publish(const std::string& topic,
+               std::string payload,
+               mqtt::publish_options options,
+               mqtt::v5::properties props = {},
+               std::function<void()> sent = {}) {
+    // the buffer keeps the payload alive, no copy
+    auto owner = std::make_shared<std::string>(std::move(payload));
+    mqtt::buffer contents(
+        mqtt::string_view(*owner),
+        mqtt::const_shared_ptr_array(owner->data(), [owner](const char*) {}));
+    boost::asio::post(_ioc, [this, topic, contents, options,
+                             props = std::move(props),
+                             sent = std::move(sent)]() {
+      const auto done =
+          sent ? std::shared_ptr<void>(nullptr, [sent](void*) { sent(); })
+               : nullptr;
+      deliver(mqtt::allocate_buffer(topic), contents, options, props, done);
+    });
+  }
+
+  // Stops accepting and drops all connections
+  void close() {
+    _server.close();
+    std::vector<std::shared_ptr<Endpoint>> endpoints;
+    for (const auto& kv : _sessions) endpoints.push_back(kv.second->endpoint);
+    for (const auto& ep : endpoints) ep->force_disconnect();
+  }
+
+  // MQTT topic matching, wildcards don't match topics starting with '$'
+  static bool matches(const std::string& filter, const std::string& topic) {
+    if (!topic.empty() && topic[0] == '$' && !filter.empty() &&
+        (filter[0] == '+' || filter[0] == '#')) {
+      return false;
+    }
+    std::size_t f = 0;
+    std::size_t t = 0;
+    for (;;) {
+      const std::size_t f_end = std::min(filter.find('/', f), filter.size());
+      const std::size_t length = f_end - f;
+      if (filter.compare(f, length, "#") == 0) return true;
+      const std::size_t t_end = std::min(topic.find('/', t), topic.size());
+      if (filter.compare(f, length, "+") != 0 &&
+          filter.compare(f, length, topic, t, t_end - t) != 0) {
+        return false;
+      }
+      if (t_end == topic.size()) {
+        // "a/#" matches "a", too
+        return f_end == filter.size() ||
+               filter.compare(f_end, std::string::npos, "/#") == 0;
+      }
+      if (f_end == filter.size()) return false;
+      f = f_end + 1;
+      t = t_end + 1;
+    }
+  }
+
+ private:
+  void accept(std::shared_ptr<Endpoint> ep) {
+    Endpoint* p = ep.get();
+    std::unique_ptr<Session> session(new Session());
+    session->endpoint = ep;
+    _sessions[p] = std::move(session);
+
+    p->set_connect_handler([this, p](mqtt::buffer client_id,
+                                     mqtt::optional<mqtt::buffer>,
+                                     mqtt::optional<mqtt::buffer>,
+                                     mqtt::optional<mqtt::will> will, bool,
+                                     std::uint16_t) {
+      if (!connect(p, std::string(client_id), std::move(will))) return false;
+      p->async_connack(false, mqtt::connect_return_code::accepted);
+      return true;
+    });
+    p->set_v5_connect_handler([this, p](mqtt::buffer client_id,
+                                        mqtt::optional<mqtt::buffer>,
+                                        mqtt::optional<mqtt::buffer>,
+                                        mqtt::optional<mqtt::will> will, bool,
+                                        std::uint16_t, mqtt::v5::properties) {
+      if (!connect(p, std::string(client_id), std::move(will))) return false;
+      p->async_connack(false, mqtt::v5::connect_reason_code::success);
+      return true;
+    });
+
+    // a clean disconnect discards the will
+    p->set_disconnect_handler([this, p]() { forget_will(p); });
+    p->set_v5_disconnect_handler(
+        [this, p](mqtt::v5::disconnect_reason_code rc, mqtt::v5::properties) {
+          if (rc != mqtt::v5::disconnect_reason_code::
+                        disconnect_with_will_message) {
+            forget_will(p);
+          }
+        });
+    p->set_close_handler([this, p]() { close(p); });
+    p->set_error_handler([this, p](mqtt::error_code) { close(p); });
+
+    p->set_pingreq_handler([p]() {
+      p->async_pingresp();
+      return true;
+    });
+
+    p->set_publish_handler([this](mqtt::optional<packet_id_t>,
+                                  mqtt::publish_options options,
+                                  mqtt::buffer topic, mqtt::buffer contents) {
+      deliver(topic, contents, options, {}, nullptr);
+      return true;
+    });
+    p->set_v5_publish_handler(
+        [this](mqtt::optional<packet_id_t>, mqtt::publish_options options,
+               mqtt::buffer topic, mqtt::buffer contents,
+               mqtt::v5::properties props) {
+          deliver(topic, contents, options, props, nullptr);
+          return true;
+        });
+
+    p->set_subscribe_handler(
+        [this, p](packet_id_t packet_id,
+                  std::vector<mqtt::subscribe_entry> entries) {
+          std::vector<mqtt::suback_return_code> codes;
+          for (const auto& e : entries) {
+            codes.push_back(
+                mqtt::qos_to_suback_return_code(e.subopts.get_qos()));
+          }
+          p->async_suback(packet_id, std::move(codes));
+          subscribe(p, entries);
+          return true;
+        });
+    p->set_v5_subscribe_handler(
+        [this, p](packet_id_t packet_id,
+                  std::vector<mqtt::subscribe_entry> entries,
+                  mqtt::v5::properties) {
+          std::vector<mqtt::v5::suback_reason_code> codes;
+          for (const auto& e : entries) {
+            codes.push_back(
+                mqtt::v5::qos_to_suback_reason_code(e.subopts.get_qos()));
+          }
+          p->async_suback(packet_id, std::move(codes));
+          subscribe(p, entries);
+          return true;
+        });
+
+    p->set_unsubscribe_handler(
+        [this, p](packet_id_t packet_id,
+                  std::vector<mqtt::unsubscribe_entry> entries) {
+          unsubscribe(p, entries);
+          p->async_unsuback(packet_id);
+          return true;
+        });
+    p->set_v5_unsubscribe_handler(
+        [this, p](packet_id_t packet_id,
+                  std::vector<mqtt::unsubscribe_entry> entries,
+                  mqtt::v5::properties) {
+          unsubscribe(p, entries);
+          p->async_unsuback(
+              packet_id,
+              std::vector<mqtt::v5::unsuback_reason_code>(
+                  entries.size(), mqtt::v5::unsuback_reason_code::success));
+          return true;
+        });
+
+    // the endpoint stays alive as long as its session runs
+    p->start_session(std::move(ep));
+  }
+
+  bool connect(Endpoint* p,
+               const std::string& client_id,
+               mqtt::optional<mqtt::will> will) {
+    const auto it = _sessions.find(p);
+    if (it == _sessions.end()) return false;
+    Session& session = *it->second;
+    // a client connecting again takes over, the old connection is dropped
+    if (!client_id.empty()) {
+      const auto previous = _client_ids.find(client_id);
+      if (previous != _client_ids.end()) {
+        previous->second->will = mqtt::nullopt;
+        previous->second->endpoint->force_disconnect();
+      }
+      _client_ids[client_id] = &session;
+    }
+    session.client_id = client_id;
+    session.will = std::move(will);
+    return true;
+  }
+
+  void forget_will(Endpoint* p) {
+    const auto it = _sessions.find(p);
+    if (it != _sessions.end()) it->second->will = mqtt::nullopt;
+  }
+
+  void close(Endpoint* p) {
+    const auto it = _sessions.find(p);
+    if (it == _sessions.end()) return;
+    std::unique_ptr<Session> session(std::move(it->second));
+    _sessions.erase(it);
+    const auto id = _client_ids.find(session->client_id);
+    if (id != _client_ids.end() && id->second == session.get()) {
+      _client_ids.erase(id);
+    }
+    const auto subscriptions = session->subscriptions;
+    for (const auto& s : subscriptions) remove(*session, s.first, s.second);
+    if (session->will) {
+      const mqtt::will& will = *session->will;
+      deliver(will.topic(), will.message(), will.get_qos() | will.get_retain(),
+              will.props(), nullptr);
+    }
+    // the endpoint is still running the handler calling us
+    boost::asio::post(_ioc, [ep = std::move(session->endpoint)]() {});
+  }
+
+  void subscribe(Endpoint* p, const std::vector<mqtt::subscribe_entry>& entries) {
+    const auto it = _sessions.find(p);
+    if (it == _sessions.end()) return;
+    for (const auto& e : entries) {
+      const std::string filter(e.topic_filter);
+      add(*it->second, std::string(e.share_name), filter, e.subopts.get_qos());
+      // retained messages are not sent to shared subscriptions
+      if (e.share_name.empty()) {
+        deliver_retained(*it->second, filter, e.subopts.get_qos());
+      }
+    }
+  }
+
+  void unsubscribe(Endpoint* p,
+                   const std::vector<mqtt::unsubscribe_entry>& entries) {
+    const auto it = _sessions.find(p);
+    if (it == _sessions.end()) return;
+    for (const auto& e : entries) {
+      remove(*it->second, std::string(e.share_name),
+             std::string(e.topic_filter));
+    }
+  }
+
+  void add(Session& session,
+           const std::string& share,
+           const std::string& filter,
+           mqtt::qos qos) {
+    auto& members = _filters[filter][share].members;
+    if (!session.subscriptions.insert({share, filter}).second) {
+      // subscribing again replaces the subscription
+      for (auto& m : members) {
+        if (m.session == &session) m.qos = qos;
+      }
+      return;
+    }
+    members.push_back({&session, qos});
+    if (filter.find_first_of("+#") != std::string::npos) {
+      _wildcards.insert(filter);
+    }
+  }
+
+  void remove(Session& session,
+              const std::string& share,
+              const std::string& filter) {
+    if (session.subscriptions.erase({share, filter}) == 0) return;
+    auto& groups = _filters[filter];
+    auto& members = groups[share].members;
+    members.erase(std::remove_if(members.begin(), members.end(),
+                                 [&](const Subscriber& s) {
+                                   return s.session == &session;
+                                 }),
+                  members.end());
+    if (!members.empty()) return;
+    groups.erase(share);
+    if (!groups.empty()) return;
+    _filters.erase(filter);
+    _wildcards.erase(filter);
+  }
+
+  void deliver(const mqtt::buffer& topic,
+               const mqtt::buffer& contents,
+               mqtt::publish_options options,
+               const mqtt::v5::properties& props,
+               const std::shared_ptr<void>& done) {
+    const std::string name(topic);
+    if (options.get_retain() == mqtt::retain::yes) {
+      if (contents.empty()) {
+        _retained.erase(name);
+      } else {
+        _retained[name] = {contents, options.get_qos(), forwarded(props)};
+      }
+    }
+    const auto it = _filters.find(name);
+    if (it != _filters.end()) {
+      deliver(it->second, topic, contents, options.get_qos(), props, done);
+    }
+    for (const auto& filter : _wildcards) {
+      if (!Broker::matches(filter, name)) continue;
+      deliver(_filters[filter], topic, contents, options.get_qos(), props,
+              done);
+    }
+  }
+
+  void deliver(std::map<std::string, Group>& groups,
+               const mqtt::buffer& topic,
+               const mqtt::buffer& contents,
+               mqtt::qos qos,
+               const mqtt::v5::properties& props,
+               const std::shared_ptr<void>& done) {
+    for (auto& kv : groups) {
+      Group& group = kv.second;
+      if (group.members.empty()) continue;
+      if (kv.first.empty()) {
+        for (const auto& s : group.members) {
+          send(s, topic, contents, std::min(qos, s.qos), mqtt::retain::no,
+               props, done);
+        }
+      } else {
+        const Subscriber& s = group.members[group.next++ % group.members.size()];
+        send(s, topic, contents, std::min(qos, s.qos), mqtt::retain::no, props,
+             done);
+      }
+    }
+  }
+
+  void deliver_retained(Session& session,
+                        const std::string& filter,
+                        mqtt::qos qos) {
+    for (const auto& kv : _retained) {
+      if (!Broker::matches(filter, kv.first)) continue;
+      send({&session, qos}, mqtt::allocate_buffer(kv.first),
+           kv.second.contents, std::min(qos, kv.second.qos), mqtt::retain::yes,
+           kv.second.props, nullptr);
+    }
+  }
+
+  void send(const Subscriber& s,
+            const mqtt::buffer& topic,
+            const mqtt::buffer& contents,
+            mqtt::qos qos,
+            mqtt::retain retain,
+            const mqtt::v5::properties& props,
+            const std::shared_ptr<void>& done) {
+    if (!s.session->endpoint) {
+      if (_local_handler) _local_handler(topic, contents, props);
+      return;
+    }
+    Endpoint& ep = *s.session->endpoint;
+    auto sent = [done](mqtt::error_code) {};
+    try {
+      if (ep.get_protocol_version() == mqtt::protocol_version::v5) {
+        ep.async_publish(topic, contents, qos | retain, forwarded(props),
+                         mqtt::any(), std::move(sent));
+      } else {
+        ep.async_publish(topic, contents, qos | retain, mqtt::any(),
+                         std::move(sent));
+      }
+    } catch (const std::exception& e) {
+      // e.g. no packet identifier left
+      std::cerr << "Embedded broker dropped message on " << topic << ": "
+                << e.what() << std::endl;
+    }
+  }
+
+  // Topic aliases and subscription identifiers are not forwarded
+  static mqtt::v5::properties forwarded(const mqtt::v5::properties& props) {
+    mqtt::v5::properties result;
+    for (const auto& p : props) {
+      bool keep = true;
+      mqtt::visit(
+          mqtt::make_lambda_visitor(
+              [&](const mqtt::v5::property::topic_alias&) { keep = false; },
+              [&](const mqtt::v5::property::subscription_identifier&) {
+                keep = false;
+              },
+              [](const auto&) {}),
+          p);
+      if (keep) result.push_back(p);
+    }
+    return result;
+  }
+};
+}  // namespace vrpc
+
+#endif
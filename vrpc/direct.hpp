@@ -0,0 +1,226 @@
+/*
+Framed TCP transport for direct (broker-less) calls.
+
+A frame is a 4 byte (little-endian) length followed by as many bytes. The
+first frame of a connection carries the token the agent announced, all
+following frames carry a single call envelope each. Calls are pipelined:
+every frame of a read is handed over at once, replies are sent in order of
+completion (matched by the call id) and replies queuing up while a write is
+in progress are sent together in a single write.
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+*/
+
+#ifndef VRPC_DIRECT_HPP
+#define VRPC_DIRECT_HPP
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#define VRPC_MAX_FRAME_SIZE (256 * 1024 * 1024)
+
+namespace vrpc {
+
+class DirectConnection
+    : public std::enable_shared_from_this<DirectConnection> {
+ public:
+  typedef std::function<void(const std::shared_ptr<DirectConnection>&,
+                             std::string frame)>
+      FrameHandler;
+
+  DirectConnection(boost::asio::ip::tcp::socket socket,
+                   const std::string& token,
+                   FrameHandler handler)
+      : _socket(std::move(socket)),
+        _token(token),
+        _handler(std::move(handler)),
+        _authenticated(false) {
+    boost::system::error_code ec;
+    _socket.set_option(boost::asio::ip::tcp::no_delay(true), ec);
+  }
+
+  void start() { read(); }
+
+  // May be called from any thread
+  void send(std::string payload) {
+    auto self(shared_from_this());
+    boost::asio::post(
+        _socket.get_executor(),
+        [this, self, payload = std::move(payload)]() mutable {
+          std::string header;
+          for (int i = 0; i < 4; ++i) {
+            header.push_back(
+                static_cast<char>((payload.size() >> (8 * i)) & 0xff));
+          }
+          _queue.push_back(std::move(header));
+          _queue.push_back(std::move(payload));
+          if (_sending.empty()) write();
+        });
+  }
+
+  void close() {
+    boost::system::error_code ec;
+    _socket.close(ec);
+  }
+
+ private:
+  void read() {
+    auto self(shared_from_this());
+    _socket.async_read_some(
+        boost::asio::buffer(_chunk),
+        [this, self](boost::system::error_code ec, std::size_t length) {
+          if (ec) {
+            close();
+            return;
+          }
+          _in.append(_chunk.data(), length);
+          if (!consume()) {
+            std::cerr << "Dropped direct connection violating the protocol"
+                      << std::endl;
+            close();
+            return;
+          }
+          read();
+        });
+  }
+
+  // Hands all complete frames over, false on protocol violations
+  bool consume() {
+    std::size_t offset = 0;
+    while (_in.size() - offset >= 4) {
+      std::uint32_t size = 0;
+      for (int i = 0; i < 4; ++i) {
+        size |= std::uint32_t(static_cast<unsigned char>(_in[offset + i]))
+                << (8 * i);
+      }
+      if (size > VRPC_MAX_FRAME_SIZE) return false;
+      // nothing is buffered for unauthenticated peers beyond the token
+      if (!_authenticated && size != _token.size()) return false;
+      if (_in.size() - offset - 4 < size) break;
+      std::string frame(_in, offset + 4, size);
+      offset += 4 + size;
+      if (!_authenticated) {
+        if (!equal_tokens(frame)) return false;
+        _authenticated = true;
+        continue;
+      }
+      _handler(shared_from_this(), std::move(frame));
+    }
+    _in.erase(0, offset);
+    return true;
+  }
+
+  // Takes as long for any token of the right size, timing tells nothing
+  bool equal_tokens(const std::string& frame) const {
+    unsigned char diff = 0;
+    for (std::size_t i = 0; i < _token.size(); ++i) {
+      diff |= static_cast<unsigned char>(frame[i] ^ _token[i]);
+    }
+    return diff == 0;
+  }
+
+  void write() {
+    _sending.swap(_queue);
+    std::vector<boost::asio::const_buffer> buffers;
+    buffers.reserve(_sending.size());
+    for (const auto& s : _sending) buffers.push_back(boost::asio::buffer(s));
+    auto self(shared_from_this());
+    boost::asio::async_write(
+        _socket, buffers,
+        [this, self](boost::system::error_code ec, std::size_t) {
+          _sending.clear();
+          if (ec) {
+            close();
+            return;
+          }
+          if (!_queue.empty()) write();
+        });
+  }
+
+  boost::asio::ip::tcp::socket _socket;
+  const std::string _token;
+  FrameHandler _handler;
+  bool _authenticated;
+  std::array<char, 64 * 1024> _chunk;
+  std::string _in;
+  // header and payload of frames waiting for, and being written
+  std::vector<std::string> _queue;
+  std::vector<std::string> _sending;
+};
+
+class DirectServer {
+  boost::asio::ip::tcp::acceptor _acceptor;
+  // waits before accepting again after an error (e.g. out of descriptors)
+  boost::asio::steady_timer _backoff;
+  const std::string _token;
+  DirectConnection::FrameHandler _handler;
+  std::vector<std::weak_ptr<DirectConnection>> _connections;
+
+ public:
+  DirectServer(boost::asio::io_context& ioc,
+               const std::string& address,
+               std::uint16_t port,
+               const std::string& token,
+               DirectConnection::FrameHandler handler)
+      : _acceptor(ioc,
+                  boost::asio::ip::tcp::endpoint(
+                      boost::asio::ip::make_address(address), port)),
+        _backoff(ioc),
+        _token(token),
+        _handler(std::move(handler)) {
+    accept();
+  }
+
+  std::uint16_t port() const { return _acceptor.local_endpoint().port(); }
+
+  // Stops accepting and drops all connections
+  void close() {
+    boost::system::error_code ec;
+    _acceptor.close(ec);
+    _backoff.cancel();
+    for (const auto& c : _connections) {
+      if (const auto connection = c.lock()) connection->close();
+    }
+    _connections.clear();
+  }
+
+ private:
+  void accept() {
+    _acceptor.async_accept([this](boost::system::error_code ec,
+                                  boost::asio::ip::tcp::socket socket) {
+      if (!_acceptor.is_open()) return;  // closed
+      if (ec) {
+        std::cerr << "Failed accepting direct connection: " << ec.message()
+                  << std::endl;
+        _backoff.expires_after(std::chrono::milliseconds(100));
+        _backoff.async_wait([this](boost::system::error_code ec) {
+          if (!ec && _acceptor.is_open()) accept();
+        });
+        return;
+      }
+      auto connection = std::make_shared<DirectConnection>(std::move(socket),
+                                                           _token, _handler);
+      _connections.erase(
+          std::remove_if(_connections.begin(), _connections.end(),
+                         [](const std::weak_ptr<DirectConnection>& c) {
+                           return c.expired();
+                         }),
+          _connections.end());
+      _connections.push_back(connection);
+      connection->start();
+      accept();
+    });
+  }
+};
+}  // namespace vrpc
+
+#endif
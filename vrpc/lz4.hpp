@@ -0,0 +1,172 @@
+/*
+Minimal, header-only implementation of the LZ4 block format
+(https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md).
+
+Used by the agent to compress large payloads, it trades compression ratio
+for speed and needs no external dependency.
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+*/
+
+#ifndef VRPC_LZ4_HPP
+#define VRPC_LZ4_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace vrpc {
+namespace lz4 {
+namespace detail {
+
+const std::size_t MIN_MATCH = 4;
+const std::size_t LAST_LITERALS = 5;
+const std::size_t MF_LIMIT = 12;
+const std::size_t MAX_OFFSET = 65535;
+const unsigned HASH_LOG = 12;
+
+inline std::uint32_t read32(const char* p) {
+  std::uint32_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline std::uint32_t hash(std::uint32_t sequence) {
+  return (sequence * 2654435761U) >> (32 - HASH_LOG);
+}
+
+inline void write_length(std::string& out, std::size_t length) {
+  while (length >= 255) {
+    out.push_back(static_cast<char>(255));
+    length -= 255;
+  }
+  out.push_back(static_cast<char>(length));
+}
+
+inline void write_sequence(std::string& out,
+                           const char* literals,
+                           std::size_t literal_length,
+                           std::size_t offset,
+                           std::size_t match_length) {
+  const std::size_t ml = match_length - MIN_MATCH;
+  const unsigned char token = static_cast<unsigned char>(
+      ((literal_length < 15 ? literal_length : 15) << 4) | (ml < 15 ? ml : 15));
+  out.push_back(static_cast<char>(token));
+  if (literal_length >= 15) write_length(out, literal_length - 15);
+  out.append(literals, literal_length);
+  out.push_back(static_cast<char>(offset & 0xff));
+  out.push_back(static_cast<char>(offset >> 8));
+  if (ml >= 15) write_length(out, ml - 15);
+}
+
+inline void write_last_literals(std::string& out,
+                                const char* literals,
+                                std::size_t literal_length) {
+  const unsigned char token = static_cast<unsigned char>(
+      (literal_length < 15 ? literal_length : 15) << 4);
+  out.push_back(static_cast<char>(token));
+  if (literal_length >= 15) write_length(out, literal_length - 15);
+  out.append(literals, literal_length);
+}
+
+inline bool read_length(const unsigned char*& ip,
+                        const unsigned char* end,
+                        std::size_t& length) {
+  unsigned char b;
+  do {
+    if (ip >= end) return false;
+    b = *ip++;
+    length += b;
+  } while (b == 255);
+  return true;
+}
+}  // namespace detail
+
+/**
+ * Compresses a buffer into a single LZ4 block.
+ *
+ * @param data Pointer to the uncompressed bytes
+ * @param size Number of uncompressed bytes
+ * @return LZ4 block (the uncompressed size is not part of it)
+ */
+inline std::string compress(const char* data, std::size_t size) {
+  using namespace detail;
+  std::string out;
+  out.reserve(size / 2 + 16);
+  std::size_t anchor = 0;
+  if (size > MF_LIMIT) {
+    std::vector<std::uint32_t> table(std::size_t(1) << HASH_LOG, 0);
+    const std::size_t match_limit = size - LAST_LITERALS;
+    std::size_t ip = 0;
+    while (ip < size - MF_LIMIT) {
+      const std::uint32_t sequence = read32(data + ip);
+      const std::uint32_t h = hash(sequence);
+      const std::size_t ref = table[h];
+      table[h] = static_cast<std::uint32_t>(ip);
+      if (ref >= ip || ip - ref > MAX_OFFSET || read32(data + ref) != sequence) {
+        ++ip;
+        continue;
+      }
+      std::size_t length = MIN_MATCH;
+      while (ip + length < match_limit && data[ref + length] == data[ip + length])
+        ++length;
+      write_sequence(out, data + anchor, ip - anchor, ip - ref, length);
+      ip += length;
+      anchor = ip;
+    }
+  }
+  write_last_literals(out, data + anchor, size - anchor);
+  return out;
+}
+
+/**
+ * Decompresses a single LZ4 block.
+ *
+ * @param data Pointer to the LZ4 block
+ * @param size Size of the LZ4 block
+ * @param original_size Expected number of uncompressed bytes
+ * @param out Receives the uncompressed bytes
+ * @return false if the block is malformed
+ */
+inline bool decompress(const char* data,
+                       std::size_t size,
+                       std::size_t original_size,
+                       std::string& out) {
+  using namespace detail;
+  out.clear();
+  // a byte of input expands to 255 bytes at most, larger claims are bogus
+  if (original_size > size * 255 + LAST_LITERALS) return false;
+  out.reserve(original_size);
+  const unsigned char* ip = reinterpret_cast<const unsigned char*>(data);
+  const unsigned char* end = ip + size;
+  while (ip < end) {
+    const unsigned char token = *ip++;
+    std::size_t literal_length = token >> 4;
+    if (literal_length == 15 && !read_length(ip, end, literal_length))
+      return false;
+    if (literal_length > std::size_t(end - ip) ||
+        out.size() + literal_length > original_size)
+      return false;
+    out.append(reinterpret_cast<const char*>(ip), literal_length);
+    ip += literal_length;
+    if (ip == end) break;  // last sequence has no match
+    if (end - ip < 2) return false;
+    const std::size_t offset = ip[0] | (std::size_t(ip[1]) << 8);
+    ip += 2;
+    std::size_t match_length = token & 0x0f;
+    if (match_length == 15 && !read_length(ip, end, match_length)) return false;
+    match_length += MIN_MATCH;
+    if (offset == 0 || offset > out.size() ||
+        out.size() + match_length > original_size)
+      return false;
+    // byte-wise copy, matches may overlap with their own output
+    std::size_t from = out.size() - offset;
+    for (std::size_t i = 0; i < match_length; ++i) out.push_back(out[from + i]);
+  }
+  return out.size() == original_size;
+}
+}  // namespace lz4
+}  // namespace vrpc
+
+#endif
@@ -9,6 +9,8 @@
 
 #include <vrpc/mqtt/variant.hpp> // should be top to configure variant limit
 
+#include <chrono>
+#include <memory>
 #include <string>
 #include <vector>
 #include <functional>
@@ -253,6 +255,20 @@ public:
         port_ = force_move(port);
     }
 
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    /**
+     * @brief Set unix domain socket path.
+     * @param path path of the broker's unix domain socket (empty to use host and port)
+     *
+     * If set, the next connect() or async_connect() call connects to this socket
+     * instead of resolving host and port. The lowest layer of the endpoint takes
+     * over the connected descriptor, so TLS works on top of it as well.
+     */
+    void set_unix_socket_path(std::string path) {
+        unix_socket_path_ = force_move(path);
+    }
+#endif // defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+
     /**
      * @brief Set client id.
      * @param id client id
@@ -359,6 +375,45 @@ public:
         return ctx_;
     }
 
+    /**
+     * @brief Set TLS session resumption.
+     * @param enable resume the session of the previous connection when reconnecting
+     *
+     * The client keeps the latest session the server issued (session ticket or id)
+     * and offers it on the next handshake. A resumed handshake skips the certificate
+     * exchange and the key agreement, which saves CPU time on both sides.
+     */
+    void set_tls_session_resumption(bool enable) {
+        static_assert(has_tls<std::decay_t<decltype(*this)>>::value, "Client is required to support TLS.");
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+        SSL_CTX* ctx = ctx_.native_handle();
+        if (enable) {
+            SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+            SSL_CTX_set_ex_data(ctx, tls_ex_data_index(), this);
+            SSL_CTX_sess_set_new_cb(ctx, &this_type::on_new_tls_session);
+        }
+        else {
+            SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+            SSL_CTX_sess_set_new_cb(ctx, nullptr);
+            tls_session_.reset();
+        }
+#else  // OPENSSL_VERSION_NUMBER >= 0x10101000L
+        (void)enable; // sessions can't be copied before OpenSSL 1.1.1
+#endif // OPENSSL_VERSION_NUMBER >= 0x10101000L
+    }
+
+    /**
+     * @brief Set TLS handshake handler.
+     * @param h handler called after each successful TLS handshake
+     *
+     * The handler receives the duration of the handshake and whether a previous
+     * session was resumed.
+     */
+    void set_tls_handshake_handler(
+        std::function<void(std::chrono::steady_clock::duration, bool)> h) {
+        tls_handshake_handler_ = force_move(h);
+    }
+
 #endif // defined(MQTT_USE_TLS)
 
 
@@ -1083,7 +1138,15 @@ private:
         tcp_endpoint<tls::stream<as::ip::tcp::socket>, Strand>& socket,
         v5::properties props,
         any session_life_keeper) {
-        socket.handshake(tls::stream_base::client);
+        before_tls_handshake(socket.socket().native_handle());
+        try {
+            socket.handshake(tls::stream_base::client);
+        }
+        catch (...) {
+            tls_session_.reset();
+            throw;
+        }
+        after_tls_handshake(socket.socket().native_handle());
         start_session(force_move(props), force_move(session_life_keeper));
     }
 
@@ -1093,8 +1156,13 @@ private:
         v5::properties props,
         any session_life_keeper,
         boost::system::error_code& ec) {
+        before_tls_handshake(socket.socket().native_handle());
         socket.handshake(tls::stream_base::client, ec);
-        if (ec) return;
+        if (ec) {
+            tls_session_.reset();
+            return;
+        }
+        after_tls_handshake(socket.socket().native_handle());
         start_session(force_move(props), force_move(session_life_keeper));
     }
 
@@ -1125,6 +1193,54 @@ private:
 
 #endif // defined(MQTT_USE_WS)
 
+#endif // defined(MQTT_USE_TLS)
+
+#if defined(MQTT_USE_TLS)
+
+    static int tls_ex_data_index() {
+        static int const index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return index;
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+
+    // Called by OpenSSL whenever the server issued a session, TLS 1.3 servers
+    // send their tickets after the handshake and possibly several of them
+    static int on_new_tls_session(SSL* ssl, SSL_SESSION* session) {
+        auto self = static_cast<this_type*>(
+            SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), tls_ex_data_index()));
+        if (!self) return 0;
+        // a copy, OpenSSL invalidates the sessions of connections that weren't
+        // shut down cleanly, which is what a broker restart looks like
+        SSL_SESSION* copy = SSL_SESSION_dup(session);
+        if (copy) self->tls_session_.reset(copy, SSL_SESSION_free);
+        return 0;
+    }
+
+#endif // OPENSSL_VERSION_NUMBER >= 0x10101000L
+
+    void before_tls_handshake(SSL* ssl) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+        if (tls_session_) {
+            SSL_SESSION* copy = SSL_SESSION_dup(tls_session_.get());
+            if (copy) {
+                SSL_set_session(ssl, copy);
+                SSL_SESSION_free(copy);
+            }
+        }
+#endif // OPENSSL_VERSION_NUMBER >= 0x10101000L
+        tls_handshake_start_ = std::chrono::steady_clock::now();
+    }
+
+    void after_tls_handshake(SSL* ssl) {
+        if (tls_handshake_handler_) {
+            tls_handshake_handler_(
+                std::chrono::steady_clock::now() - tls_handshake_start_,
+                SSL_session_reused(ssl) == 1
+            );
+        }
+    }
+
 #endif // defined(MQTT_USE_TLS)
 
     template <typename Strand>
@@ -1171,20 +1287,24 @@ private:
         v5::properties props,
         any session_life_keeper,
         async_handler_t func) {
+        before_tls_handshake(socket.socket().native_handle());
         socket.async_handshake(
             tls::stream_base::client,
             [
                 this,
                 self = this->shared_from_this(),
+                &socket,
                 session_life_keeper = force_move(session_life_keeper),
                 props = force_move(props),
                 func = force_move(func)
             ]
             (error_code ec) mutable {
                 if (ec) {
+                  tls_session_.reset();
                   if (func) func(ec);
                   return;
                 }
+                after_tls_handshake(socket.socket().native_handle());
                 async_start_session(force_move(props), force_move(session_life_keeper), force_move(func));
             });
     }
@@ -1234,12 +1354,42 @@ private:
 
 #endif // defined(MQTT_USE_TLS)
 
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    // Stream I/O doesn't depend on the protocol, the (TCP typed) lowest layer
+    // can operate on the descriptor of a connected unix domain socket.
+    void adopt_local_socket(as::local::stream_protocol::socket& local, error_code& ec) {
+        auto& ll = socket_->lowest_layer();
+        error_code close_ec;
+        ll.close(close_ec);
+        auto fd = local.release(ec);
+        if (ec) return;
+        ll.assign(as::ip::tcp::v4(), fd, ec);
+        if (ec) {
+            // hand it back, so it gets closed
+            error_code assign_ec;
+            local.assign(as::local::stream_protocol(), fd, assign_ec);
+        }
+    }
+#endif // defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+
     void connect_impl(
         v5::properties props,
         any session_life_keeper) {
-        as::ip::tcp::resolver r(ioc_);
-        auto eps = r.resolve(host_, port_);
-        as::connect(socket_->lowest_layer(), eps.begin(), eps.end());
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+        if (!unix_socket_path_.empty()) {
+            as::local::stream_protocol::socket local(ioc_);
+            local.connect(as::local::stream_protocol::endpoint(unix_socket_path_));
+            error_code ec;
+            adopt_local_socket(local, ec);
+            if (ec) throw boost::system::system_error(ec);
+        }
+        else
+#endif // defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+        {
+            as::ip::tcp::resolver r(ioc_);
+            auto eps = r.resolve(host_, port_);
+            as::connect(socket_->lowest_layer(), eps.begin(), eps.end());
+        }
         base::set_connect();
         if (ping_duration_ != std::chrono::steady_clock::duration::zero()) {
             set_timer();
@@ -1251,11 +1401,23 @@ private:
         v5::properties props,
         any session_life_keeper,
         boost::system::error_code& ec) {
-        as::ip::tcp::resolver r(ioc_);
-        auto eps = r.resolve(host_, port_, ec);
-        if (ec) return;
-        as::connect(socket_->lowest_layer(), eps.begin(), eps.end(), ec);
-        if (ec) return;
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+        if (!unix_socket_path_.empty()) {
+            as::local::stream_protocol::socket local(ioc_);
+            local.connect(as::local::stream_protocol::endpoint(unix_socket_path_), ec);
+            if (ec) return;
+            adopt_local_socket(local, ec);
+            if (ec) return;
+        }
+        else
+#endif // defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+        {
+            as::ip::tcp::resolver r(ioc_);
+            auto eps = r.resolve(host_, port_, ec);
+            if (ec) return;
+            as::connect(socket_->lowest_layer(), eps.begin(), eps.end(), ec);
+            if (ec) return;
+        }
         base::set_connect();
         if (ping_duration_ != std::chrono::steady_clock::duration::zero()) {
             set_timer();
@@ -1267,6 +1429,36 @@ private:
         v5::properties props,
         any session_life_keeper,
         async_handler_t func) {
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+        if (!unix_socket_path_.empty()) {
+            auto local = std::make_shared<as::local::stream_protocol::socket>(ioc_);
+            auto p = local.get();
+            p->async_connect(
+                as::local::stream_protocol::endpoint(unix_socket_path_),
+                [
+                    this,
+                    self = this->shared_from_this(),
+                    props = force_move(props),
+                    session_life_keeper = force_move(session_life_keeper),
+                    func = force_move(func),
+                    local = force_move(local)
+                ]
+                (error_code ec) mutable {
+                    if (!ec) adopt_local_socket(*local, ec);
+                    if (ec) {
+                        if (func) func(ec);
+                        return;
+                    }
+                    base::set_connect();
+                    if (ping_duration_ != std::chrono::steady_clock::duration::zero()) {
+                        set_timer();
+                    }
+                    async_handshake_socket(*socket_, force_move(props), force_move(session_life_keeper), force_move(func));
+                }
+            );
+            return;
+        }
+#endif // defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
         auto r = std::make_shared<as::ip::tcp::resolver>(ioc_);
         auto p = r.get();
         p->async_resolve(
@@ -1394,6 +1586,9 @@ private:
     as::steady_timer tim_close_;
     std::string host_;
     std::string port_;
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    std::string unix_socket_path_;
+#endif // defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
     std::uint16_t keep_alive_sec_{0};
     std::chrono::steady_clock::duration ping_duration_{std::chrono::steady_clock::duration::zero()};
     std::string client_id_;
@@ -1403,6 +1598,9 @@ private:
     bool async_pingreq_ = false;
 #if defined(MQTT_USE_TLS)
     tls::context ctx_{tls::context::tlsv12};
+    std::shared_ptr<SSL_SESSION> tls_session_;
+    std::chrono::steady_clock::time_point tls_handshake_start_;
+    std::function<void(std::chrono::steady_clock::duration, bool)> tls_handshake_handler_;
 #endif // defined(MQTT_USE_TLS)
 #if defined(MQTT_USE_WS)
     std::string path_;
@@ -10156,7 +10156,8 @@ private:
             std::size_t const size = MQTT_NS::size<PacketIdBytes>(mv);
 
             // If we hit the byte limit, we don't include this buffer for this send.
-            if (max_queue_send_size_ != 0 && max_queue_send_size_ < total_bytes + size) {
+            // The first message is always sent, even if it exceeds the limit on its own.
+            if (it != start && max_queue_send_size_ != 0 && max_queue_send_size_ < total_bytes + size) {
                 end = it;
                 iterator_count = boost::numeric_cast<std::size_t>(std::distance(start, end));
                 break;
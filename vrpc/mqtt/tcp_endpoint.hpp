@@ -7,6 +7,10 @@
 #if !defined(MQTT_TCP_ENDPOINT_HPP)
 #define MQTT_TCP_ENDPOINT_HPP
 
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
 #include <boost/asio.hpp>
 #include <boost/asio/bind_executor.hpp>
 
@@ -15,6 +19,12 @@
 #include <vrpc/mqtt/move.hpp>
 #include <vrpc/mqtt/attributes.hpp>
 
+// Bytes read at once, packets (or their parts) already received are handed
+// out without another read
+#if !defined(MQTT_READ_AHEAD_SIZE)
+#define MQTT_READ_AHEAD_SIZE (64 * 1024)
+#endif // !defined(MQTT_READ_AHEAD_SIZE)
+
 namespace MQTT_NS {
 
 namespace as = boost::asio;
@@ -28,16 +38,56 @@ public:
          strand_(ioc) {
     }
 
+    // The endpoint reads the fixed header, the remaining length and the body
+    // of a packet separately, a single read of the socket usually covers
+    // them all (and those of the following packets)
     MQTT_ALWAYS_INLINE void async_read(
         as::mutable_buffer buffers,
         std::function<void(error_code, std::size_t)> handler
     ) override final {
+        std::size_t copied = take(buffers);
+        if (copied == buffers.size()) {
+            as::post(
+                strand_,
+                [handler = force_move(handler), copied] {
+                    handler(error_code(), copied);
+                }
+            );
+            return;
+        }
+        buffers += copied;
+        if (buffers.size() >= MQTT_READ_AHEAD_SIZE) {
+            // large bodies are read in place
+            as::async_read(
+                tcp_,
+                buffers,
+                as::bind_executor(
+                    strand_,
+                    [handler = force_move(handler), copied]
+                    (error_code ec, std::size_t bytes_transferred) {
+                        handler(ec, copied + bytes_transferred);
+                    }
+                )
+            );
+            return;
+        }
+        read_ahead_.resize(MQTT_READ_AHEAD_SIZE);
         as::async_read(
             tcp_,
-            force_move(buffers),
+            as::buffer(read_ahead_),
+            as::transfer_at_least(buffers.size()),
             as::bind_executor(
                 strand_,
-                force_move(handler)
+                [this, buffers, handler = force_move(handler), copied]
+                (error_code ec, std::size_t bytes_transferred) {
+                    read_begin_ = 0;
+                    read_end_ = bytes_transferred;
+                    if (ec) {
+                        handler(ec, copied);
+                        return;
+                    }
+                    handler(ec, copied + take(buffers));
+                }
             )
         );
     }
@@ -120,8 +170,21 @@ public:
 #endif // defined(MQTT_USE_TLS)
 
 private:
+    // Moves read ahead bytes into buffers, returns their number
+    std::size_t take(as::mutable_buffer buffers) {
+        std::size_t size = std::min(buffers.size(), read_end_ - read_begin_);
+        if (size > 0) {
+            std::memcpy(buffers.data(), read_ahead_.data() + read_begin_, size);
+            read_begin_ += size;
+        }
+        return size;
+    }
+
     Socket tcp_;
     Strand strand_;
+    std::vector<char> read_ahead_;
+    std::size_t read_begin_ = 0;
+    std::size_t read_end_ = 0;
 };
 
 } // namespace MQTT_NS
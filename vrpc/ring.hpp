@@ -0,0 +1,458 @@
+/*
+Shared-memory ring buffers for calls of clients on the same host.
+
+On request of a client (through MQTT) the agent creates a segment holding two
+single-producer/single-consumer rings, one carrying requests to the agent and
+one carrying replies back, and the client opens it by the path it is told.
+The segment is sealed against resizing, so a client can't make the agent fault
+by truncating it. A message is a 4 byte
+(little-endian) length followed by as many bytes, wrapping around at the end
+of the ring. Read and write positions are ever increasing counters living on
+separate cache lines, so neither side needs a lock. A reader spins for a short
+while before it sleeps on a futex, writers only issue the wake-up syscall if
+the reader announced to sleep.
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+*/
+
+#ifndef VRPC_RING_HPP
+#define VRPC_RING_HPP
+
+#ifdef __linux__
+#define VRPC_HAS_RING
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <boost/asio.hpp>
+
+// "VRNG"
+#define VRPC_RING_MAGIC 0x474e5256u
+#define VRPC_RING_MIN_CAPACITY 4096
+#define VRPC_RING_MAX_CAPACITY (16 * 1024 * 1024)
+
+namespace vrpc {
+namespace detail {
+
+static_assert(sizeof(std::atomic<std::uint32_t>) == sizeof(std::uint32_t),
+              "futex words must be plain 32 bit integers");
+
+inline void futex_wait(std::atomic<std::uint32_t>& word,
+                       std::uint32_t expected,
+                       std::chrono::milliseconds timeout) {
+  timespec ts;
+  ts.tv_sec = timeout.count() / 1000;
+  ts.tv_nsec = (timeout.count() % 1000) * 1000000;
+  // not FUTEX_PRIVATE_FLAG, the word is shared between processes
+  ::syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAIT,
+            expected, &ts, nullptr, 0);
+}
+
+inline void futex_wake(std::atomic<std::uint32_t>& word) {
+  ::syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAKE,
+            INT_MAX, nullptr, nullptr, 0);
+}
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+struct RingHeader {
+  // next position to read, written by the consumer only
+  alignas(64) std::atomic<std::uint64_t> head;
+  // next position to write, written by the producer only
+  alignas(64) std::atomic<std::uint64_t> tail;
+  // set by a consumer about to sleep, signal is the futex word
+  alignas(64) std::atomic<std::uint32_t> sleeping;
+  std::atomic<std::uint32_t> signal;
+};
+
+struct ChannelHeader {
+  std::uint32_t magic;
+  std::uint32_t capacity;
+  // process id of the client
+  std::int32_t pid;
+  std::atomic<std::uint32_t> closed;
+};
+
+inline std::size_t channel_size(std::size_t capacity) {
+  const std::size_t header = (sizeof(ChannelHeader) + 63) / 64 * 64;
+  return header + 2 * (sizeof(RingHeader) + capacity);
+}
+}  // namespace detail
+
+class Ring {
+  detail::RingHeader* _header;
+  char* _data;
+  std::uint64_t _capacity;
+
+ public:
+  Ring(detail::RingHeader* header, char* data, std::uint64_t capacity)
+      : _header(header), _data(data), _capacity(capacity) {}
+
+  std::size_t max_message_size() const { return _capacity - 4; }
+
+  // Producer only, false if the ring has no room for the message
+  bool try_write(const char* data, std::size_t size) {
+    const std::uint64_t tail = _header->tail.load(std::memory_order_relaxed);
+    const std::uint64_t head = _header->head.load(std::memory_order_acquire);
+    if (size > max_message_size() || _capacity - (tail - head) < 4 + size) {
+      return false;
+    }
+    char length[4];
+    for (int i = 0; i < 4; ++i) {
+      length[i] = static_cast<char>((size >> (8 * i)) & 0xff);
+    }
+    copy_in(tail, length, 4);
+    copy_in(tail + 4, data, size);
+    // pairs with the consumer announcing to sleep (both sequentially
+    // consistent), either it sees the message or we see it sleeping
+    _header->tail.store(tail + 4 + size);
+    if (_header->sleeping.load()) wake();
+    return true;
+  }
+
+  // Consumer only, false if the ring is empty, throws if the producer wrote
+  // positions or lengths that can't be right
+  bool try_read(std::string& out) {
+    const std::uint64_t head = _header->head.load(std::memory_order_relaxed);
+    const std::uint64_t tail = _header->tail.load(std::memory_order_acquire);
+    if (tail == head) return false;
+    const std::uint64_t used = tail - head;
+    if (used < 4 || used > _capacity) {
+      throw std::runtime_error("Corrupt ring: invalid positions");
+    }
+    char length[4];
+    copy_out(head, length, 4);
+    std::uint32_t size = 0;
+    for (int i = 0; i < 4; ++i) {
+      size |= std::uint32_t(static_cast<unsigned char>(length[i])) << (8 * i);
+    }
+    if (size > used - 4 || size > max_message_size()) {
+      throw std::runtime_error("Corrupt ring: invalid message length");
+    }
+    out.resize(size);
+    copy_out(head + 4, &out[0], size);
+    _header->head.store(head + 4 + size, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only, spins for a while and sleeps afterwards, false if nothing
+  // arrived (the ring may have been woken up for closing)
+  bool read(std::string& out,
+            std::chrono::microseconds spin,
+            std::chrono::milliseconds timeout) {
+    const auto until = std::chrono::steady_clock::now() + spin;
+    do {
+      if (try_read(out)) return true;
+      detail::cpu_relax();
+    } while (std::chrono::steady_clock::now() < until);
+    const std::uint32_t signal = _header->signal.load();
+    _header->sleeping.store(1);
+    // the tail must not be read before the store above is visible, the
+    // producer stores its tail before it checks for sleepers
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!try_read(out)) {
+      detail::futex_wait(_header->signal, signal, timeout);
+      _header->sleeping.store(0);
+      return try_read(out);
+    }
+    _header->sleeping.store(0);
+    return true;
+  }
+
+  void wake() {
+    _header->signal.fetch_add(1);
+    detail::futex_wake(_header->signal);
+  }
+
+ private:
+  void copy_in(std::uint64_t position, const char* data, std::size_t size) {
+    const std::size_t offset = position & (_capacity - 1);
+    const std::size_t first = std::min<std::size_t>(size, _capacity - offset);
+    std::memcpy(_data + offset, data, first);
+    std::memcpy(_data, data + first, size - first);
+  }
+
+  void copy_out(std::uint64_t position, char* data, std::size_t size) const {
+    const std::size_t offset = position & (_capacity - 1);
+    const std::size_t first = std::min<std::size_t>(size, _capacity - offset);
+    std::memcpy(data, _data + offset, first);
+    std::memcpy(data + first, _data, size - first);
+  }
+};
+
+class RingChannel {
+  std::string _name;
+  // kept open by the agent, a client opens the segment through it
+  int _fd;
+  void* _addr;
+  std::size_t _size;
+  // process id of the client, a vanished client is detached
+  std::int32_t _pid;
+  detail::ChannelHeader* _header;
+  std::unique_ptr<Ring> _requests;
+  std::unique_ptr<Ring> _replies;
+
+ public:
+  /**
+   * Creates a new channel (agent side), its name is the path a client on the
+   * same host (and in the same pid namespace) opens it by.
+   *
+   * @param capacity Bytes per ring, rounded up to a power of two
+   * @param pid Process id of the client
+   */
+  static std::unique_ptr<RingChannel> create(std::size_t capacity,
+                                             std::int32_t pid) {
+    if (capacity > VRPC_RING_MAX_CAPACITY) {
+      throw std::runtime_error("Ring capacity exceeds " +
+                               std::to_string(VRPC_RING_MAX_CAPACITY));
+    }
+    std::size_t c = VRPC_RING_MIN_CAPACITY;
+    while (c < capacity) c <<= 1;
+    const std::size_t size = detail::channel_size(c);
+    const int fd = ::memfd_create("vrpc-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+      throw std::runtime_error("Failed creating shared memory");
+    }
+    void* addr = MAP_FAILED;
+    // accessing pages truncated away would raise SIGBUS
+    if (::ftruncate(fd, size) == 0 &&
+        ::fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) ==
+            0) {
+      addr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (addr == MAP_FAILED) {
+      ::close(fd);
+      throw std::runtime_error("Failed mapping shared memory");
+    }
+    auto header = new (addr) detail::ChannelHeader();
+    header->magic = VRPC_RING_MAGIC;
+    header->capacity = static_cast<std::uint32_t>(c);
+    header->pid = pid;
+    header->closed = 0;
+    const std::string name("/proc/" + std::to_string(::getpid()) + "/fd/" +
+                           std::to_string(fd));
+    return std::unique_ptr<RingChannel>(
+        new RingChannel(name, fd, addr, size, pid, true));
+  }
+
+  /**
+   * Opens a channel the agent created (client side).
+   *
+   * @param name Path of the channel, as answered by the agent
+   */
+  static std::unique_ptr<RingChannel> open(const std::string& name) {
+    const int fd = ::open(name.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+      throw std::runtime_error("Failed opening shared memory: " + name);
+    }
+    struct stat st;
+    void* addr = MAP_FAILED;
+    if (::fstat(fd, &st) == 0 &&
+        std::size_t(st.st_size) >= detail::channel_size(0)) {
+      addr = ::mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    fd, 0);
+    }
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+      throw std::runtime_error("Failed mapping shared memory: " + name);
+    }
+    const auto header = static_cast<const detail::ChannelHeader*>(addr);
+    const std::size_t c = header->capacity;
+    if (header->magic != VRPC_RING_MAGIC || c < VRPC_RING_MIN_CAPACITY ||
+        (c & (c - 1)) != 0 ||
+        detail::channel_size(c) != std::size_t(st.st_size)) {
+      ::munmap(addr, st.st_size);
+      throw std::runtime_error("Invalid ring channel: " + name);
+    }
+    return std::unique_ptr<RingChannel>(
+        new RingChannel(name, -1, addr, st.st_size, header->pid, false));
+  }
+
+  ~RingChannel() {
+    ::munmap(_addr, _size);
+    if (_fd >= 0) ::close(_fd);
+  }
+
+  RingChannel(const RingChannel&) = delete;
+  RingChannel& operator=(const RingChannel&) = delete;
+
+  const std::string& name() const { return _name; }
+
+  // Written by the client, read by the agent
+  Ring& requests() { return *_requests; }
+
+  // Written by the agent, read by the client
+  Ring& replies() { return *_replies; }
+
+  bool closed() const { return _header->closed.load() != 0; }
+
+  // Tells the other side and wakes up both readers
+  void close() {
+    _header->closed.store(1);
+    _requests->wake();
+    _replies->wake();
+  }
+
+  bool client_alive() const { return ::kill(_pid, 0) == 0 || errno != ESRCH; }
+
+ private:
+  RingChannel(const std::string& name,
+              int fd,
+              void* addr,
+              std::size_t size,
+              std::int32_t pid,
+              bool init)
+      : _name(name),
+        _fd(fd),
+        _addr(addr),
+        _size(size),
+        _pid(pid),
+        _header(static_cast<detail::ChannelHeader*>(addr)) {
+    const std::size_t capacity = _header->capacity;
+    char* p = static_cast<char*>(addr) + (sizeof(detail::ChannelHeader) + 63) /
+                                             64 * 64;
+    for (auto ring : {&_requests, &_replies}) {
+      auto header = init ? new (p) detail::RingHeader()
+                         : reinterpret_cast<detail::RingHeader*>(p);
+      if (init) {
+        header->head = 0;
+        header->tail = 0;
+        header->sleeping = 0;
+        header->signal = 0;
+      }
+      ring->reset(new Ring(header, p + sizeof(detail::RingHeader), capacity));
+      p += sizeof(detail::RingHeader) + capacity;
+    }
+  }
+};
+
+// Agent side of a channel, a thread reads the requests and hands them over
+// in batches, replies are written from the event-loop
+class RingConnection : public std::enable_shared_from_this<RingConnection> {
+ public:
+  typedef std::function<void(std::vector<std::string> frames)> FrameHandler;
+  typedef std::function<void()> CloseHandler;
+
+  RingConnection(boost::asio::io_context& ioc,
+                 std::unique_ptr<RingChannel> channel,
+                 std::chrono::microseconds spin,
+                 FrameHandler handler,
+                 CloseHandler on_close)
+      : _channel(std::move(channel)),
+        _spin(spin),
+        _handler(std::move(handler)),
+        _on_close(std::move(on_close)),
+        _timer(ioc) {}
+
+  ~RingConnection() { close(); }
+
+  void start() { _reader = std::thread([this]() { read(); }); }
+
+  std::size_t max_message_size() const {
+    return _channel->replies().max_message_size();
+  }
+
+  // Event-loop only (single producer), replies wait while the ring is full
+  void send(std::string payload) {
+    if (payload.size() > max_message_size()) {
+      std::cerr << "Dropped reply exceeding the ring capacity" << std::endl;
+      return;
+    }
+    if (_pending.empty() &&
+        _channel->replies().try_write(payload.data(), payload.size())) {
+      return;
+    }
+    _pending.push_back(std::move(payload));
+    if (_pending.size() == 1) flush_later();
+  }
+
+  void close() {
+    _channel->close();
+    _timer.cancel();
+    if (_reader.joinable()) _reader.join();
+  }
+
+ private:
+  void read() {
+    std::vector<std::string> frames;
+    std::string frame;
+    Ring& requests = _channel->requests();
+    try {
+      while (!_channel->closed()) {
+        if (!requests.read(frame, _spin, std::chrono::milliseconds(1000))) {
+          if (!_channel->client_alive()) break;
+          continue;
+        }
+        frames.push_back(std::move(frame));
+        // whatever else is there goes along
+        while (frames.size() < 256 && requests.try_read(frame)) {
+          frames.push_back(std::move(frame));
+        }
+        _handler(std::move(frames));
+        frames.clear();
+      }
+    } catch (const std::exception& e) {
+      std::cerr << "Closing ring channel " << _channel->name() << ": "
+                << e.what() << std::endl;
+      _channel->close();
+    }
+    _on_close();
+  }
+
+  // The client drains its ring without telling, so we check back shortly
+  void flush_later() {
+    auto self(shared_from_this());
+    _timer.expires_after(std::chrono::microseconds(200));
+    _timer.async_wait([this, self](boost::system::error_code ec) {
+      if (ec || _channel->closed()) {
+        _pending.clear();
+        return;
+      }
+      while (!_pending.empty() &&
+             _channel->replies().try_write(_pending.front().data(),
+                                           _pending.front().size())) {
+        _pending.pop_front();
+      }
+      if (!_pending.empty()) flush_later();
+    });
+  }
+
+  std::unique_ptr<RingChannel> _channel;
+  const std::chrono::microseconds _spin;
+  FrameHandler _handler;
+  CloseHandler _on_close;
+  boost::asio::steady_timer _timer;
+  std::deque<std::string> _pending;
+  std::thread _reader;
+};
+}  // namespace vrpc
+
+#endif  // __linux__
+
+#endif